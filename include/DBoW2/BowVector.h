@@ -11,16 +11,22 @@
 #define __D_T_BOW_VECTOR__
 
 #include <iostream>
-#include <map>
 #include <vector>
+#include <utility>
+#include <algorithm>
 
 namespace DBoW2 {
 
 /// Id of words
 typedef unsigned int WordId;
 
-/// Value of a word
+/// Value of a word. Single precision halves the size of the postings of
+/// the inverted file, and the scores are still accumulated in double
+#ifdef DBOW2_FLOAT_WORD_VALUE
+typedef float WordValue;
+#else
 typedef double WordValue;
+#endif
 
 /// Id of nodes in the vocabulary treee
 typedef unsigned int NodeId;
@@ -53,11 +59,27 @@ enum ScoringType
 };
 
 /// Vector of words to represent images
+/**
+ * Words are stored as <id, value> pairs in a contiguous array sorted by 
+ * id, without repeated ids. Besides the interface of std::vector, the 
+ * vector provides the lookup functions of std::map<WordId, WordValue>, 
+ * so that it can be used as one. Inserting a word in the middle costs 
+ * O(N), so vectors should be built in increasing id order when possible.
+ */
 class BowVector: 
-	public std::map<WordId, WordValue>
+	public std::vector<std::pair<WordId, WordValue> >
 {
 public:
 
+	/// Word id
+	typedef WordId key_type;
+  
+	/// Word value
+	typedef WordValue mapped_type;
+  
+	using std::vector<std::pair<WordId, WordValue> >::insert;
+	using std::vector<std::pair<WordId, WordValue> >::erase;
+
 	/** 
 	 * Constructor
 	 */
@@ -83,12 +105,87 @@ public:
 	 */
 	void addIfNotExist(WordId id, WordValue v);
 
+	/**
+	 * Replaces the content of the vector with some words
+	 * @param words (in/out) <word id, value> pairs, in any order. They are 
+	 *   sorted by id
+	 * @param accumulate if true, the values of repeated words are added up,
+	 *   as with addWeight. Otherwise, the first value of each word is kept, 
+	 *   as with addIfNotExist
+	 */
+	void setWords(std::vector<std::pair<WordId, WordValue> > &words, 
+		bool accumulate);
+
+	/**
+	 * Changes the ids of the words, e.g. after renumbering the words of 
+	 * the vocabulary
+	 * @param new_ids new id of each old word id
+	 */
+	void renumber(const std::vector<WordId> &new_ids);
+
 	/**
 	 * L1-Normalizes the values in the vector 
 	 * @param norm_type norm used
 	 */
 	void normalize(LNorm norm_type);
 	
+	/**
+	 * Returns the first word whose id is not lower than the given one
+	 * @param id word id
+	 * @return iterator to the word, or end()
+	 */
+	inline iterator lower_bound(WordId id);
+	inline const_iterator lower_bound(WordId id) const;
+	
+	/**
+	 * Returns the first word at or after a position whose id is not lower
+	 * than the given one. The word is searched for by galloping from the 
+	 * position, so that walking two vectors to find their common words 
+	 * costs O(log) in the gaps between them
+	 * @param it position to search from
+	 * @param id word id
+	 * @return iterator to the word, or end()
+	 */
+	inline const_iterator seek(const_iterator it, WordId id) const;
+	
+	/**
+	 * Finds a word
+	 * @param id word id
+	 * @return iterator to the word, or end() if it is not in the vector
+	 */
+	inline iterator find(WordId id);
+	inline const_iterator find(WordId id) const;
+	
+	/**
+	 * Counts the words with an id
+	 * @param id word id
+	 * @return 1 if the word is in the vector, 0 otherwise
+	 */
+	inline size_t count(WordId id) const;
+	
+	/**
+	 * Returns the value of a word, which is created with value 0 if it does
+	 * not exist
+	 * @param id word id
+	 * @return reference to the value
+	 */
+	inline WordValue& operator[](WordId id);
+	
+	/**
+	 * Inserts a word if it does not exist yet
+	 * @param w <id, value> pair
+	 * @return iterator to the word with the id of w, and true iff it was
+	 *   inserted
+	 */
+	std::pair<iterator, bool> insert(const value_type &w);
+	
+	/**
+	 * Removes a word
+	 * @param id word id
+	 * @return number of words removed (0 or 1)
+	 */
+	size_t erase(WordId id);
+	
 	/**
 	 * Prints the content of the bow vector
 	 * @param out stream
@@ -102,8 +199,103 @@ public:
 	 * @param W number of words in the vocabulary
 	 */
 	void saveM(const std::string &filename, size_t W) const;
+
+protected:
+
+	/**
+	 * Compares the id of a word with an id
+	 * @param w word
+	 * @param id
+	 * @return true iff the id of w < id
+	 */
+	static inline bool ltId(const value_type &w, WordId id)
+	{
+		return w.first < id;
+	}
+	
+	/**
+	 * Compares the ids of two words
+	 * @param a
+	 * @param b
+	 * @return true iff the id of a < the id of b
+	 */
+	static inline bool ltWord(const value_type &a, const value_type &b)
+	{
+		return a.first < b.first;
+	}
 };
 
+// --------------------------------------------------------------------------
+
+inline BowVector::iterator BowVector::lower_bound(WordId id)
+{
+  return std::lower_bound(begin(), end(), id, ltId);
+}
+
+// --------------------------------------------------------------------------
+
+inline BowVector::const_iterator BowVector::lower_bound(WordId id) const
+{
+  return std::lower_bound(begin(), end(), id, ltId);
+}
+
+// --------------------------------------------------------------------------
+
+inline BowVector::const_iterator BowVector::seek(const_iterator it, 
+  WordId id) const
+{
+  const const_iterator last = end();
+  
+  // the step doubles while the words are < id, and the word is then
+  // searched for within the last step
+  size_t step = 1;
+  while(it != last && it->first < id)
+  {
+    if((size_t)(last - it) <= step) 
+      return std::lower_bound(it + 1, last, id, ltId);
+    
+    if(it[step].first >= id)
+      return std::lower_bound(it + 1, it + step + 1, id, ltId);
+    
+    it += step;
+    step *= 2;
+  }
+  
+  return it;
+}
+
+// --------------------------------------------------------------------------
+
+inline BowVector::iterator BowVector::find(WordId id)
+{
+  iterator it = lower_bound(id);
+  return (it != end() && it->first == id ? it : end());
+}
+
+// --------------------------------------------------------------------------
+
+inline BowVector::const_iterator BowVector::find(WordId id) const
+{
+  const_iterator it = lower_bound(id);
+  return (it != end() && it->first == id ? it : end());
+}
+
+// --------------------------------------------------------------------------
+
+inline size_t BowVector::count(WordId id) const
+{
+  return (find(id) != end() ? 1 : 0);
+}
+
+// --------------------------------------------------------------------------
+
+inline WordValue& BowVector::operator[](WordId id)
+{
+  return insert(value_type(id, 0)).first->second;
+}
+
+// --------------------------------------------------------------------------
+
 } // namespace DBoW2
 
 #endif
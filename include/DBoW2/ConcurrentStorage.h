@@ -0,0 +1,870 @@
+/**
+ * File: ConcurrentStorage.h
+ * Date: October 2026
+ * Description: containers with one writer and many concurrent readers
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_CONCURRENT_STORAGE__
+#define __D_T_CONCURRENT_STORAGE__
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <utility>
+#include <new>
+
+namespace DBoW2 {
+
+/// Frees the memory retired by a writer once no reader can be using it
+/**
+ * Readers enter the reclaimer before reading shared buffers and leave it
+ * when done. Readers are counted in one of two epochs. When the writer
+ * retires a buffer, the buffer is kept until the readers of the previous
+ * epoch are gone and the epoch changes, so long-running readers only
+ * delay reclamation, and the writer never waits for them.
+ */
+class MemoryReclaimer
+{
+public:
+
+  /// Registers a reader during its lifetime
+  class ReadGuard
+  {
+  public:
+    /**
+     * Enters the reclaimer as a reader
+     * @param rec reclaimer
+     */
+    inline explicit ReadGuard(const MemoryReclaimer &rec)
+      : m_rec(rec), m_epoch(rec.enter()) {}
+    
+    /**
+     * Leaves the reclaimer
+     */
+    inline ~ReadGuard() { m_rec.leave(m_epoch); }
+    
+  private:
+    ReadGuard(const ReadGuard &);
+    ReadGuard& operator=(const ReadGuard &);
+    
+    const MemoryReclaimer &m_rec;
+    unsigned int m_epoch;
+  };
+
+public:
+
+  /**
+   * Creates a reclaimer without readers
+   */
+  MemoryReclaimer(void);
+  
+  /**
+   * Frees all the retired memory. There must not be any reader
+   */
+  ~MemoryReclaimer(void);
+  
+  /**
+   * Enters as a reader
+   * @return epoch the reader belongs to, to be given to leave
+   */
+  inline unsigned int enter() const;
+  
+  /**
+   * Leaves as a reader
+   * @param epoch value returned by enter
+   */
+  inline void leave(unsigned int epoch) const;
+  
+  /**
+   * Retires a block allocated with ::operator new. It is freed when no 
+   * reader can be using it. Only the writer can call this
+   * @param p memory block
+   * @param destroy function that frees the block, or NULL to free it
+   *   with ::operator delete
+   */
+  void retire(void *p, void (*destroy)(void*) = NULL);
+  
+  /**
+   * Retires an object allocated with new. It is deleted when no reader
+   * can be using it. Only the writer can call this
+   * @param p object
+   */
+  template<class T>
+  inline void retireObject(T *p) { retire(p, &destroyObject<T>); }
+  
+  /**
+   * Frees the retired blocks that are no longer used. Only the writer can
+   * call this
+   */
+  void collect();
+
+private:
+  MemoryReclaimer(const MemoryReclaimer &);
+  MemoryReclaimer& operator=(const MemoryReclaimer &);
+
+  /// Retired block and the function that frees it (NULL: operator delete)
+  typedef std::pair<void*, void (*)(void*)> Retired;
+
+  /**
+   * Deletes an object retired with retireObject
+   * @param p object
+   */
+  template<class T>
+  static void destroyObject(void *p) { delete static_cast<T*>(p); }
+
+  /**
+   * Frees some retired blocks
+   * @param blocks
+   */
+  static void free(const std::vector<Retired> &blocks);
+
+  /// Current epoch (0 or 1)
+  mutable std::atomic<unsigned int> m_epoch;
+  
+  /// Number of readers in each epoch
+  mutable std::atomic<int> m_readers[2];
+  
+  /// Blocks retired in the current epoch
+  std::vector<Retired> m_pending;
+  
+  /// Blocks retired in the previous epoch
+  std::vector<Retired> m_waiting;
+};
+
+// --------------------------------------------------------------------------
+
+inline unsigned int MemoryReclaimer::enter() const
+{
+  unsigned int epoch = m_epoch.load();
+  m_readers[epoch].fetch_add(1);
+  return epoch;
+}
+
+// --------------------------------------------------------------------------
+
+inline void MemoryReclaimer::leave(unsigned int epoch) const
+{
+  m_readers[epoch].fetch_sub(1, std::memory_order_release);
+}
+
+// --------------------------------------------------------------------------
+// --------------------------------------------------------------------------
+
+/// Array of trivially copyable items with one writer and many readers
+/**
+ * The items live in a buffer that also stores how many of them are 
+ * valid. Appending writes the item and then publishes the new size, so
+ * readers see a consistent prefix of the array. When the buffer is full,
+ * or its content is replaced, a new buffer is published and the old one
+ * is retired to a MemoryReclaimer. Readers must get a Snapshot while 
+ * registered in the same reclaimer. Each buffer also stores a header value
+ * that describes its items, so that readers get the header of the items
+ * they see.
+ * @param T item type. Must be trivially copyable
+ * @param H header type. Must be trivially copyable
+ */
+template<class T, class H = char>
+class PublishedArray
+{
+public:
+
+  /// Iterator of items
+  typedef const T* const_iterator;
+  
+  /// Consistent view of the items of the array
+  class Snapshot
+  {
+  public:
+    /**
+     * Creates a view of the given items
+     * @param first
+     * @param last
+     * @param header header of the items
+     */
+    inline Snapshot(const T *first, const T *last, const H &header = H())
+      : m_first(first), m_last(last), m_header(header) {}
+    
+    /// Returns the first item
+    inline const_iterator begin() const { return m_first; }
+    
+    /// Returns the end of the items
+    inline const_iterator end() const { return m_last; }
+    
+    /// Returns the number of items
+    inline unsigned int size() const 
+      { return (unsigned int)(m_last - m_first); }
+    
+    /// Returns whether there are no items
+    inline bool empty() const { return m_first == m_last; }
+    
+    /// Returns the i-th item
+    inline const T& operator[](unsigned int i) const { return m_first[i]; }
+    
+    /// Returns the header of the items
+    inline const H& header() const { return m_header; }
+    
+  private:
+    const T *m_first, *m_last;
+    H m_header;
+  };
+
+public:
+
+  /**
+   * Creates an empty array
+   */
+  PublishedArray(void): m_buf(NULL) {}
+  
+  /**
+   * Copies an array. Not thread safe
+   * @param a
+   */
+  PublishedArray(const PublishedArray<T, H> &a): m_buf(NULL) { *this = a; }
+  
+  /**
+   * Frees the buffer. There must not be any reader
+   */
+  ~PublishedArray(void) { ::operator delete(m_buf.load()); }
+  
+  /**
+   * Copies an array. Not thread safe
+   * @param a
+   */
+  PublishedArray<T, H>& operator=(const PublishedArray<T, H> &a);
+
+  /**
+   * Returns a consistent view of the current items. Can be called by 
+   * readers
+   * @return view
+   */
+  inline Snapshot snapshot() const;
+  
+  /**
+   * Returns the number of items
+   * @return size
+   */
+  inline unsigned int size() const;
+  
+  /**
+   * Returns the number of items that fit in the buffer
+   * @return capacity
+   */
+  inline unsigned int capacity() const;
+  
+  /**
+   * Returns the header of the current items, or H() if there are none
+   * @return header
+   */
+  inline H header() const;
+  
+  /**
+   * Appends an item. Only the writer can call this
+   * @param v item
+   * @param rec reclaimer where the readers are registered
+   */
+  inline void push_back(const T &v, MemoryReclaimer &rec);
+  
+  /**
+   * Appends several items, that readers see at once. Only the writer can
+   * call this
+   * @param first first item
+   * @param last end of the items
+   * @param rec reclaimer where the readers are registered
+   */
+  void append(const T *first, const T *last, MemoryReclaimer &rec);
+  
+  /**
+   * Makes room for n items. Only the writer can call this
+   * @param n
+   * @param rec reclaimer where the readers are registered
+   */
+  void reserve(unsigned int n, MemoryReclaimer &rec);
+  
+  /**
+   * Replaces the items of the array, keeping the header. Readers keep 
+   * seeing the old items until they get a new snapshot. Only the writer 
+   * can call this
+   * @param first first new item
+   * @param last end of the new items
+   * @param rec reclaimer where the readers are registered
+   */
+  void assign(const T *first, const T *last, MemoryReclaimer &rec);
+  
+  /**
+   * Replaces the items of the array and their header. Readers keep seeing
+   * the old items until they get a new snapshot. Only the writer can call
+   * this
+   * @param first first new item
+   * @param last end of the new items
+   * @param header header of the new items
+   * @param rec reclaimer where the readers are registered
+   * @param capacity minimum capacity of the new buffer. If > 0, the 
+   *   header is kept even if there are no items
+   */
+  void assign(const T *first, const T *last, const H &header,
+    MemoryReclaimer &rec, unsigned int capacity = 0);
+  
+  /**
+   * Removes all the items and frees the buffer. Only the writer can call
+   * this
+   * @param rec reclaimer where the readers are registered
+   */
+  void clear(MemoryReclaimer &rec);
+
+protected:
+
+  /// Header of a buffer, followed by the items
+  struct Buffer
+  {
+    /// Number of items that fit in the buffer
+    unsigned int capacity;
+    /// Number of valid items
+    std::atomic<unsigned int> size;
+    /// Header of the items
+    H header;
+  };
+  
+  /**
+   * Returns the items of a buffer
+   * @param b buffer
+   * @return pointer to first item
+   */
+  static inline T* items(Buffer *b)
+  {
+    return reinterpret_cast<T*>(reinterpret_cast<char*>(b) + offset());
+  }
+  
+  /**
+   * Returns the offset of the items from the start of a buffer
+   * @return offset in bytes
+   */
+  static inline size_t offset()
+  {
+    return (sizeof(Buffer) + sizeof(T) - 1) / sizeof(T) * sizeof(T);
+  }
+  
+  /**
+   * Allocates a buffer with the given items
+   * @param capacity
+   * @param first first item to copy
+   * @param n number of items to copy
+   * @param header header of the items
+   * @return new buffer
+   */
+  static Buffer* allocate(unsigned int capacity, const T *first, 
+    unsigned int n, const H &header);
+
+protected:
+
+  /// Current buffer, NULL if empty
+  std::atomic<Buffer*> m_buf;
+};
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+PublishedArray<T, H>& PublishedArray<T, H>::operator=
+  (const PublishedArray<T, H> &a)
+{
+  if(this != &a)
+  {
+    ::operator delete(m_buf.load());
+    m_buf.store(NULL);
+    
+    Buffer *b = a.m_buf.load();
+    if(b)
+    {
+      const unsigned int n = b->size.load();
+      if(n > 0) m_buf.store(allocate(n, items(b), n, b->header));
+    }
+  }
+  return *this;
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+inline typename PublishedArray<T, H>::Snapshot 
+PublishedArray<T, H>::snapshot() const
+{
+  Buffer *b = m_buf.load();
+  if(!b) return Snapshot(NULL, NULL);
+  
+  const T *first = items(b);
+  return Snapshot(first, first + b->size.load(std::memory_order_acquire),
+    b->header);
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+inline unsigned int PublishedArray<T, H>::size() const
+{
+  Buffer *b = m_buf.load();
+  return b ? b->size.load(std::memory_order_acquire) : 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+inline unsigned int PublishedArray<T, H>::capacity() const
+{
+  Buffer *b = m_buf.load();
+  return b ? b->capacity : 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+inline H PublishedArray<T, H>::header() const
+{
+  Buffer *b = m_buf.load();
+  return b ? b->header : H();
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+inline void PublishedArray<T, H>::push_back(const T &v, MemoryReclaimer &rec)
+{
+  Buffer *b = m_buf.load(std::memory_order_relaxed);
+  const unsigned int n = (b ? b->size.load(std::memory_order_relaxed) : 0);
+  
+  if(!b || n == b->capacity)
+  {
+    reserve(n < 4 ? 4 : n * 2, rec);
+    b = m_buf.load(std::memory_order_relaxed);
+  }
+  
+  items(b)[n] = v;
+  b->size.store(n + 1, std::memory_order_release);
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+void PublishedArray<T, H>::append(const T *first, const T *last, 
+  MemoryReclaimer &rec)
+{
+  const unsigned int m = (unsigned int)(last - first);
+  if(m == 0) return;
+  
+  Buffer *b = m_buf.load(std::memory_order_relaxed);
+  const unsigned int n = (b ? b->size.load(std::memory_order_relaxed) : 0);
+  
+  if(!b || n + m > b->capacity)
+  {
+    reserve(std::max(n + m, n * 2), rec);
+    b = m_buf.load(std::memory_order_relaxed);
+  }
+  
+  memcpy(items(b) + n, first, m * sizeof(T));
+  b->size.store(n + m, std::memory_order_release);
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+void PublishedArray<T, H>::reserve(unsigned int n, MemoryReclaimer &rec)
+{
+  Buffer *b = m_buf.load(std::memory_order_relaxed);
+  if(n <= capacity()) return;
+  
+  if(!b)
+  {
+    m_buf.store(allocate(n, NULL, 0, H()));
+  }
+  else
+  {
+    m_buf.store(allocate(n, items(b), b->size.load(), b->header));
+    rec.retire(b);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+void PublishedArray<T, H>::assign(const T *first, const T *last, 
+  MemoryReclaimer &rec)
+{
+  assign(first, last, header(), rec);
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+void PublishedArray<T, H>::assign(const T *first, const T *last, 
+  const H &header, MemoryReclaimer &rec, unsigned int capacity)
+{
+  const unsigned int n = (unsigned int)(last - first);
+  Buffer *b = m_buf.load(std::memory_order_relaxed);
+  
+  if(n > 0 || capacity > 0)
+    m_buf.store(allocate(std::max(n, capacity), first, n, header));
+  else
+    m_buf.store(NULL);
+  
+  if(b) rec.retire(b);
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+void PublishedArray<T, H>::clear(MemoryReclaimer &rec)
+{
+  Buffer *b = m_buf.load(std::memory_order_relaxed);
+  m_buf.store(NULL);
+  if(b) rec.retire(b);
+}
+
+// --------------------------------------------------------------------------
+
+template<class T, class H>
+typename PublishedArray<T, H>::Buffer* PublishedArray<T, H>::allocate
+  (unsigned int capacity, const T *first, unsigned int n, const H &header)
+{
+  Buffer *b = static_cast<Buffer*>(
+    ::operator new(offset() + capacity * sizeof(T)));
+  b->capacity = capacity;
+  new(&b->size) std::atomic<unsigned int>(n);
+  b->header = header;
+  if(n > 0) std::memcpy(items(b), first, n * sizeof(T));
+  return b;
+}
+
+// --------------------------------------------------------------------------
+// --------------------------------------------------------------------------
+
+/// Array whose items never move, with one writer and many readers
+/**
+ * Items are stored in segments of growing size that are never 
+ * reallocated, so references to items remain valid while the array 
+ * grows, and readers can access the items below a size they got from the 
+ * writer while it appends new ones.
+ * @param T item type
+ */
+template<class T>
+class SegmentedArray
+{
+public:
+
+  /**
+   * Creates an empty array
+   */
+  SegmentedArray(void): m_size(0)
+  {
+    for(int i = 0; i < NSEGMENTS; ++i) m_segments[i].store(NULL);
+  }
+  
+  /**
+   * Copies an array. Not thread safe
+   * @param a
+   */
+  SegmentedArray(const SegmentedArray<T> &a): m_size(0)
+  {
+    for(int i = 0; i < NSEGMENTS; ++i) m_segments[i].store(NULL);
+    *this = a;
+  }
+  
+  /**
+   * Frees the items
+   */
+  ~SegmentedArray(void) { release(); }
+  
+  /**
+   * Copies an array. Not thread safe
+   * @param a
+   */
+  SegmentedArray<T>& operator=(const SegmentedArray<T> &a);
+  
+  /**
+   * Returns the number of items
+   * @return size
+   */
+  inline unsigned int size() const { return m_size; }
+  
+  /**
+   * Changes the number of items. New items are default values. Growing
+   * the array does not affect the readers of the current items. Only the
+   * writer can call this
+   * @param n new size
+   */
+  void resize(unsigned int n);
+  
+  /**
+   * Removes all the items and frees the memory. Not thread safe
+   */
+  inline void clear() { release(); }
+  
+  /**
+   * Returns an item
+   * @param i index (must be < size())
+   * @return item
+   */
+  inline T& operator[](unsigned int i);
+  
+  /**
+   * Returns an item
+   * @param i index (must be < size())
+   * @return item
+   */
+  inline const T& operator[](unsigned int i) const;
+
+protected:
+
+  /**
+   * Returns the segment and the offset of an item
+   * @param i item index
+   * @param s (out) segment index
+   * @return offset of the item in the segment
+   */
+  static inline unsigned int locate(unsigned int i, int &s)
+  {
+    // segment s holds FIRST_SEGMENT << s items
+    unsigned int start = 0, len = FIRST_SEGMENT;
+    for(s = 0; i - start >= len; ++s)
+    {
+      start += len;
+      len <<= 1;
+    }
+    return i - start;
+  }
+  
+  /**
+   * Frees all the segments
+   */
+  void release();
+
+protected:
+
+  /// Number of segments
+  static const int NSEGMENTS = 26;
+  
+  /// Number of items of the first segment
+  static const unsigned int FIRST_SEGMENT = 64;
+  
+  /// Segments
+  std::atomic<T*> m_segments[NSEGMENTS];
+  
+  /// Number of items
+  unsigned int m_size;
+};
+
+// --------------------------------------------------------------------------
+
+template<class T>
+SegmentedArray<T>& SegmentedArray<T>::operator=(const SegmentedArray<T> &a)
+{
+  if(this != &a)
+  {
+    release();
+    resize(a.size());
+    for(unsigned int i = 0; i < a.size(); ++i) (*this)[i] = a[i];
+  }
+  return *this;
+}
+
+// --------------------------------------------------------------------------
+
+template<class T>
+void SegmentedArray<T>::resize(unsigned int n)
+{
+  if(n > m_size)
+  {
+    int s;
+    locate(n - 1, s);
+    
+    unsigned int len = FIRST_SEGMENT;
+    for(int i = 0; i <= s; ++i, len <<= 1)
+    {
+      if(!m_segments[i].load(std::memory_order_relaxed))
+        m_segments[i].store(new T[len], std::memory_order_release);
+    }
+  }
+  else
+  {
+    for(unsigned int i = n; i < m_size; ++i) (*this)[i] = T();
+  }
+  m_size = n;
+}
+
+// --------------------------------------------------------------------------
+
+template<class T>
+inline T& SegmentedArray<T>::operator[](unsigned int i)
+{
+  int s;
+  unsigned int offset = locate(i, s);
+  return m_segments[s].load(std::memory_order_acquire)[offset];
+}
+
+// --------------------------------------------------------------------------
+
+template<class T>
+inline const T& SegmentedArray<T>::operator[](unsigned int i) const
+{
+  int s;
+  unsigned int offset = locate(i, s);
+  return m_segments[s].load(std::memory_order_acquire)[offset];
+}
+
+// --------------------------------------------------------------------------
+
+template<class T>
+void SegmentedArray<T>::release()
+{
+  for(int i = 0; i < NSEGMENTS; ++i)
+  {
+    delete [] m_segments[i].load();
+    m_segments[i].store(NULL);
+  }
+  m_size = 0;
+}
+
+// --------------------------------------------------------------------------
+
+/// Object with one writer and many readers, replaced as a whole
+/**
+ * The object lives in the heap. The writer replaces it by publishing a
+ * new one and retiring the old one to a MemoryReclaimer, so readers 
+ * registered in the same reclaimer can keep using the object they got.
+ * Copying the container copies the object.
+ * @param T type of object. Must be default constructible
+ */
+template<class T>
+class PublishedValue
+{
+public:
+
+  /**
+   * Creates an empty container, whose value is T()
+   */
+  PublishedValue(void): m_p(NULL) {}
+  
+  /**
+   * Copies a value. Not thread safe
+   * @param v
+   */
+  PublishedValue(const PublishedValue<T> &v): m_p(NULL) { *this = v; }
+  
+  /**
+   * Deletes the object
+   */
+  ~PublishedValue(void) { delete m_p.load(); }
+  
+  /**
+   * Copies a value. Not thread safe
+   * @param v
+   */
+  PublishedValue<T>& operator=(const PublishedValue<T> &v)
+  {
+    if(this != &v)
+    {
+      const T *p = v.m_p.load();
+      delete m_p.load();
+      m_p.store(p ? new T(*p) : NULL);
+    }
+    return *this;
+  }
+  
+  /**
+   * Returns the current object
+   * @return object, valid while the reader is registered in the reclaimer
+   *   given to the writer
+   */
+  inline const T& get() const
+  {
+    static const T empty;
+    const T *p = m_p.load(std::memory_order_acquire);
+    return (p ? *p : empty);
+  }
+  
+  /**
+   * Replaces the object with a copy of the given one. Only the writer can
+   * call this
+   * @param v new value
+   * @param rec reclaimer where the readers are registered
+   */
+  void assign(const T &v, MemoryReclaimer &rec)
+  {
+    T *old = m_p.load(std::memory_order_relaxed);
+    m_p.store(new T(v), std::memory_order_release);
+    if(old) rec.retireObject(old);
+  }
+  
+  /**
+   * Replaces the object with T(). Only the writer can call this
+   * @param rec reclaimer where the readers are registered
+   */
+  void reset(MemoryReclaimer &rec)
+  {
+    T *old = m_p.load(std::memory_order_relaxed);
+    m_p.store(NULL, std::memory_order_release);
+    if(old) rec.retireObject(old);
+  }
+
+private:
+
+  /// Current object, NULL if empty
+  std::atomic<T*> m_p;
+};
+
+// --------------------------------------------------------------------------
+
+/// Atomic value that can be copied, so that it can be stored in containers
+/**
+ * Loads and stores are atomic, but copying a value is not.
+ * @param T type of value
+ */
+template<class T>
+class AtomicValue
+{
+public:
+
+  /**
+   * Creates a value
+   * @param v initial value
+   */
+  AtomicValue(T v = T()): m_v(v) {}
+  
+  /**
+   * Copies a value
+   * @param a
+   */
+  AtomicValue(const AtomicValue<T> &a): m_v(a.load()) {}
+  
+  /**
+   * Copies a value
+   * @param a
+   */
+  inline AtomicValue<T>& operator=(const AtomicValue<T> &a)
+  {
+    store(a.load());
+    return *this;
+  }
+  
+  /**
+   * Returns the value
+   * @return value
+   */
+  inline T load() const { return m_v.load(std::memory_order_acquire); }
+  
+  /**
+   * Sets the value
+   * @param v new value
+   */
+  inline void store(T v) { m_v.store(v, std::memory_order_release); }
+
+private:
+  std::atomic<T> m_v;
+};
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
@@ -51,6 +51,7 @@ namespace DBoW2
 
 #include "TemplatedVocabulary.h"
 #include "TemplatedDatabase.h"
+#include "TemplatedMatcher.h"
 #include "BowVector.h"
 #include "FeatureVector.h"
 #include "QueryResults.h"
@@ -64,6 +65,10 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FORB::TDescriptor, DBoW2::FORB>
 /// FORB Database
 typedef DBoW2::TemplatedDatabase<DBoW2::FORB::TDescriptor, DBoW2::FORB> 
   OrbDatabase;
+
+/// ORB Matcher
+typedef DBoW2::TemplatedMatcher<DBoW2::FORB::TDescriptor, DBoW2::FORB> 
+  OrbMatcher;
   
 /// BRIEF Vocabulary
 typedef DBoW2::TemplatedVocabulary<DBoW2::FBrief::TDescriptor, DBoW2::FBrief> 
@@ -73,5 +78,9 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FBrief::TDescriptor, DBoW2::FBrief>
 typedef DBoW2::TemplatedDatabase<DBoW2::FBrief::TDescriptor, DBoW2::FBrief> 
   BriefDatabase;
 
+/// BRIEF Matcher
+typedef DBoW2::TemplatedMatcher<DBoW2::FBrief::TDescriptor, DBoW2::FBrief> 
+  BriefMatcher;
+
 #endif
 
@@ -0,0 +1,65 @@
+/**
+ * File: DeltaCodec.h
+ * Date: October 2026
+ * Description: compression of increasing entry ids
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_DELTA_CODEC__
+#define __D_T_DELTA_CODEC__
+
+#include <cstddef>
+#include "QueryResults.h"
+
+namespace DBoW2 {
+
+/// Compression of increasing entry ids
+/**
+ * Ids are stored as the differences with the previous one, in the
+ * StreamVByte format: one control byte for each group of four
+ * differences, with the number of bytes of each one (1 to 4), followed by
+ * the bytes of all the differences. With SSSE3, a group is decoded with
+ * a single shuffle, and the differences are added with a prefix sum.
+ */
+class DeltaCodec
+{
+public:
+
+  /**
+   * Returns the maximum number of bytes of some encoded ids
+   * @param n number of ids
+   * @return bytes
+   */
+  static inline size_t maxBytes(unsigned int n)
+    { return (n + 3) / 4 + 4 * (size_t)n; }
+
+  /**
+   * Encodes some ids
+   * @param ids increasing ids
+   * @param n number of ids
+   * @param base value before the first id (<= ids[0])
+   * @param out (out) buffer with room for maxBytes(n) bytes
+   * @return number of bytes written
+   */
+  static size_t encode(const EntryId *ids, unsigned int n, EntryId base,
+    unsigned char *out);
+
+  /**
+   * Decodes some ids
+   * @param in encoded ids
+   * @param bytes number of bytes that can be read from in. Decoding is
+   *   faster if there are 16 bytes more than those of the ids
+   * @param n number of ids
+   * @param base value before the first id, as given to encode
+   * @param ids (out) n ids. There must be room for n rounded up to a
+   *   multiple of 4, since the last group is decoded whole
+   * @return number of bytes of the encoded ids
+   */
+  static size_t decode(const unsigned char *in, size_t bytes,
+    unsigned int n, EntryId base, EntryId *ids);
+};
+
+} // namespace DBoW2
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * File: EntryRange.h
+ * Date: October 2026
+ * Description: range of entry ids a query is restricted to
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_ENTRY_RANGE__
+#define __D_T_ENTRY_RANGE__
+
+#include "QueryResults.h"
+
+namespace DBoW2 {
+
+/// Range of entry ids a query is restricted to
+/**
+ * Since the inverted rows are sorted by entry id, the postings out of the
+ * range are skipped without being read.
+ * A typical use is loop detection, that must ignore the last entries 
+ * added: EntryRange::excludingLast(n)
+ */
+class EntryRange
+{
+public:
+
+  /// First entry id of the range
+  int first;
+  
+  /// Entry id after the last one of the range. < 0 means up to the last
+  /// entry of the database
+  int last;
+  
+  /// Number of entries most recently added to the database that are 
+  /// excluded too
+  unsigned int exclude_last;
+
+public:
+
+  /**
+   * Creates a range with all the entries
+   */
+  EntryRange(): first(0), last(-1), exclude_last(0) {}
+  
+  /**
+   * Creates a range [_first, _last)
+   * @param _first first entry id
+   * @param _last entry id after the last one. < 0 means up to the last 
+   *   entry
+   * @param _exclude_last number of most recent entries excluded
+   */
+  explicit EntryRange(int _first, int _last = -1, 
+    unsigned int _exclude_last = 0)
+    : first(_first), last(_last), exclude_last(_exclude_last) {}
+  
+  /**
+   * Creates a range with all the entries but the last n ones
+   * @param n number of most recent entries excluded
+   * @return range
+   */
+  static inline EntryRange excludingLast(unsigned int n)
+  {
+    return EntryRange(0, -1, n);
+  }
+  
+  /**
+   * Computes the entry ids of the range in a database 
+   * @param nentries number of entries in the database
+   * @param begin (out) first entry id
+   * @param end (out) entry id after the last one. begin == end if the
+   *   range is empty
+   */
+  inline void resolve(int nentries, int &begin, int &end) const
+  {
+    end = (last < 0 || last > nentries ? nentries : last);
+    
+    if(exclude_last >= (unsigned int)nentries) end = 0;
+    else if(end > nentries - (int)exclude_last) 
+      end = nentries - (int)exclude_last;
+    
+    begin = (first > 0 ? first : 0);
+    if(begin > end) begin = end;
+  }
+};
+
+} // namespace DBoW2
+
+#endif
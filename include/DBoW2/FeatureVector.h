@@ -11,28 +11,212 @@
 #define __D_T_FEATURE_VECTOR__
 
 #include "BowVector.h"
-#include <map>
 #include <vector>
+#include <utility>
+#include <iterator>
 #include <iostream>
+#include <cstddef>
 
 namespace DBoW2 {
 
 /// Vector of nodes with indexes of local features
-class FeatureVector: 
-  public std::map<NodeId, std::vector<unsigned int> >
+/**
+ * The vector is stored in compressed sparse row form: the sorted ids of
+ * the nodes, the offset of the features of each node, and the indexes of
+ * all the features packed in one array, with 16 bits each while they are
+ * lower than 65536. Nodes are iterated as in a
+ * std::map<NodeId, std::vector<unsigned int> >, but they cannot be
+ * modified through the iterators. Adding features to nodes in increasing
+ * id order is O(1); adding them to nodes in the middle is O(N), so that
+ * unsorted features should be given with setFeatures.
+ */
+class FeatureVector
 {
+public:
+
+  /// Indexes of the features of a node
+  class Features
+  {
+  public:
+
+    /// Random access iterator over the indexes
+    class const_iterator
+    {
+    public:
+
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef unsigned int value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const unsigned int* pointer;
+      typedef unsigned int reference;
+
+      const_iterator(): m_narrow(NULL), m_wide(NULL), m_i(0) {}
+      const_iterator(const unsigned short *narrow, const unsigned int *wide,
+        size_t i): m_narrow(narrow), m_wide(wide), m_i(i) {}
+
+      inline unsigned int operator*() const
+        { return (m_wide ? m_wide[m_i] : m_narrow[m_i]); }
+      inline unsigned int operator[](std::ptrdiff_t n) const
+        { return *(*this + n); }
+
+      inline const_iterator& operator++() { ++m_i; return *this; }
+      inline const_iterator& operator--() { --m_i; return *this; }
+      inline const_iterator operator++(int)
+        { const_iterator it(*this); ++m_i; return it; }
+      inline const_iterator operator--(int)
+        { const_iterator it(*this); --m_i; return it; }
+      inline const_iterator& operator+=(std::ptrdiff_t n)
+        { m_i += n; return *this; }
+      inline const_iterator& operator-=(std::ptrdiff_t n)
+        { m_i -= n; return *this; }
+      inline const_iterator operator+(std::ptrdiff_t n) const
+        { return const_iterator(m_narrow, m_wide, m_i + n); }
+      inline const_iterator operator-(std::ptrdiff_t n) const
+        { return const_iterator(m_narrow, m_wide, m_i - n); }
+      inline std::ptrdiff_t operator-(const const_iterator &it) const
+        { return (std::ptrdiff_t)m_i - (std::ptrdiff_t)it.m_i; }
+
+      inline bool operator==(const const_iterator &it) const
+        { return m_i == it.m_i; }
+      inline bool operator!=(const const_iterator &it) const
+        { return m_i != it.m_i; }
+      inline bool operator<(const const_iterator &it) const
+        { return m_i < it.m_i; }
+
+    protected:
+      const unsigned short *m_narrow;
+      const unsigned int *m_wide;
+      size_t m_i;
+    };
+
+    typedef const_iterator iterator;
+
+  public:
+
+    /**
+     * Creates a list of indexes
+     * @param narrow 16-bit indexes, or NULL
+     * @param wide 32-bit indexes, or NULL
+     * @param n number of indexes
+     */
+    Features(const unsigned short *narrow, const unsigned int *wide,
+      unsigned int n): m_narrow(narrow), m_wide(wide), m_size(n) {}
+
+    /**
+     * Returns an index
+     * @param i position (< size())
+     * @return feature index
+     */
+    inline unsigned int operator[](size_t i) const
+    {
+      return (m_wide ? m_wide[i] : m_narrow[i]);
+    }
+
+    inline size_t size() const { return m_size; }
+    inline bool empty() const { return m_size == 0; }
+    inline unsigned int front() const { return (*this)[0]; }
+    inline unsigned int back() const { return (*this)[m_size - 1]; }
+    inline const_iterator begin() const
+      { return const_iterator(m_narrow, m_wide, 0); }
+    inline const_iterator end() const
+      { return const_iterator(m_narrow, m_wide, m_size); }
+
+    /**
+     * Copies the indexes into a vector
+     * @return vector of feature indexes
+     */
+    inline operator std::vector<unsigned int>() const
+    {
+      std::vector<unsigned int> v(m_size);
+      for(unsigned int i = 0; i < m_size; ++i) v[i] = (*this)[i];
+      return v;
+    }
+
+  protected:
+    const unsigned short *m_narrow;
+    const unsigned int *m_wide;
+    unsigned int m_size;
+  };
+
+  /// Node id and features of a node
+  struct Node
+  {
+    /// Node id
+    NodeId first;
+
+    /// Feature indexes
+    Features second;
+
+    Node(NodeId id, const Features &f): first(id), second(f) {}
+  };
+
+  /// Iterator over the nodes, that yields them by value
+  class const_iterator
+  {
+  public:
+
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef Node value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Node* pointer;
+    typedef Node reference;
+
+    /// Node returned by operator->
+    struct Pointer
+    {
+      Node node;
+      inline const Node* operator->() const { return &node; }
+    };
+
+    const_iterator(): m_v(NULL), m_i(0) {}
+    const_iterator(const FeatureVector *v, size_t i): m_v(v), m_i(i) {}
+
+    inline Node operator*() const { return m_v->node(m_i); }
+    inline Pointer operator->() const
+    {
+      Pointer p = { m_v->node(m_i) };
+      return p;
+    }
+
+    inline const_iterator& operator++() { ++m_i; return *this; }
+    inline const_iterator& operator--() { --m_i; return *this; }
+    inline const_iterator operator++(int)
+      { const_iterator it(*this); ++m_i; return it; }
+    inline const_iterator operator--(int)
+      { const_iterator it(*this); --m_i; return it; }
+
+    inline bool operator==(const const_iterator &it) const
+      { return m_i == it.m_i; }
+    inline bool operator!=(const const_iterator &it) const
+      { return m_i != it.m_i; }
+
+    /**
+     * Returns the position of the node in the vector
+     * @return position
+     */
+    inline size_t index() const { return m_i; }
+
+  protected:
+    const FeatureVector *m_v;
+    size_t m_i;
+  };
+
+  typedef const_iterator iterator;
+  typedef Node value_type;
+  typedef NodeId key_type;
+
 public:
 
   /**
    * Constructor
    */
   FeatureVector(void);
-  
+
   /**
    * Destructor
    */
   ~FeatureVector(void);
-  
+
   /**
    * Adds a feature to an existing node, or adds a new node with an initial
    * feature
@@ -41,13 +225,126 @@ public:
    */
   void addFeature(NodeId id, unsigned int i_feature);
 
+  /**
+   * Replaces the content of the vector with some features
+   * @param features (in/out) <node id, feature index> pairs, in any order.
+   *   They are sorted by node id, keeping the order of the features of
+   *   each node
+   */
+  void setFeatures(std::vector<std::pair<NodeId, unsigned int> > &features);
+
+  /**
+   * Removes all the nodes
+   */
+  void clear();
+
+  /**
+   * Returns the number of nodes
+   * @return number of nodes
+   */
+  inline size_t size() const { return m_nodes.size(); }
+
+  /**
+   * Checks if there are no nodes
+   * @return true iff empty
+   */
+  inline bool empty() const { return m_nodes.empty(); }
+
+  inline const_iterator begin() const { return const_iterator(this, 0); }
+  inline const_iterator end() const
+    { return const_iterator(this, m_nodes.size()); }
+
+  /**
+   * Returns the first node whose id is not lower than the given one
+   * @param id node id
+   * @return iterator to the node, or end()
+   */
+  const_iterator lower_bound(NodeId id) const;
+
+  /**
+   * Finds a node
+   * @param id node id
+   * @return iterator to the node, or end() if it is not in the vector
+   */
+  const_iterator find(NodeId id) const;
+
+  /**
+   * Counts the nodes with an id
+   * @param id node id
+   * @return 1 if the node is in the vector, 0 otherwise
+   */
+  inline size_t count(NodeId id) const { return find(id) != end() ? 1 : 0; }
+
+  /**
+   * Returns a node
+   * @param i position of the node (< size())
+   * @return node
+   */
+  inline Node node(size_t i) const
+  {
+    const unsigned int first = m_offsets[i];
+    const unsigned int n = m_offsets[i+1] - first;
+    return (m_is_wide ?
+      Node(m_nodes[i], Features(NULL, m_wide.data() + first, n)) :
+      Node(m_nodes[i], Features(m_narrow.data() + first, NULL, n)));
+  }
+
+  /**
+   * Returns the number of feature indexes of all the nodes
+   * @return number of indexes
+   */
+  inline size_t features() const
+    { return m_offsets.empty() ? 0 : m_offsets.back(); }
+
+  /**
+   * Returns the memory used by the vector
+   * @return bytes
+   */
+  size_t memoryUsage() const;
+
+  /**
+   * Frees the memory reserved but not used
+   */
+  void shrink();
+
   /**
    * Sends a string versions of the feature vector through the stream
    * @param out stream
    * @param v feature vector
    */
   friend std::ostream& operator<<(std::ostream &out, const FeatureVector &v);
-    
+
+protected:
+
+  /**
+   * Stores the indexes with 32 bits
+   */
+  void widen();
+
+  /**
+   * Inserts a feature index at a position of the packed array
+   * @param pos position
+   * @param i_feature index
+   */
+  void insertIndex(unsigned int pos, unsigned int i_feature);
+
+protected:
+
+  /// Sorted node ids
+  std::vector<NodeId> m_nodes;
+
+  /// Position in the index array of the first feature of each node, and
+  /// the number of indexes at the end (size() + 1 items, or none)
+  std::vector<unsigned int> m_offsets;
+
+  /// Feature indexes, if all of them are < 65536
+  std::vector<unsigned short> m_narrow;
+
+  /// Feature indexes, otherwise
+  std::vector<unsigned int> m_wide;
+
+  /// Whether indexes are stored in m_wide
+  bool m_is_wide;
 };
 
 } // namespace DBoW2
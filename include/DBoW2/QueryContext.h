@@ -0,0 +1,71 @@
+/**
+ * File: QueryContext.h
+ * Date: October 2026
+ * Description: reusable scratch memory for database queries
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_QUERY_CONTEXT__
+#define __D_T_QUERY_CONTEXT__
+
+#include <vector>
+#include "BowVector.h"
+#include "QueryResults.h"
+#include "ScoreAccumulator.h"
+
+namespace DBoW2 {
+
+/// Scratch memory used by database queries
+/**
+ * A context owns the buffers a query needs, so that they are allocated
+ * only once when the same context is given to consecutive queries. 
+ * A context can be used by only one query at a time, so each thread 
+ * must have its own.
+ */
+class QueryContext
+{
+public:
+
+  /// Accumulator of entry scores
+  ScoreAccumulator scores;
+  
+  /// Bow vector of the query features
+  BowVector vec;
+  
+  /// Accumulators of the threads of a query that runs on several threads
+  /// (the first one uses scores)
+  std::vector<ScoreAccumulator> thread_scores;
+  
+  /// Results selected by the threads of a query
+  std::vector<QueryResults> thread_results;
+  
+  /// Step to read the inverted row of each word of the query (0 if the 
+  /// row is skipped), or empty if all the rows are read
+  std::vector<unsigned int> steps;
+  
+  /// Number of rows of the last query that were skipped or subsampled
+  /// because of the stop list of the database
+  unsigned int stop_words;
+  
+  /// Number of postings the last query did not read because of the stop
+  /// list of the database
+  size_t skipped_postings;
+  
+  /// Minimum number of words the results of the queries run with this
+  /// context must have in common with them. < 0 uses the minimum set in
+  /// the database (TemplatedDatabase::setMinCommonWords)
+  int min_common_words;
+  
+public:
+
+  /**
+   * Creates an empty context
+   */
+  QueryContext(): stop_words(0), skipped_postings(0), 
+    min_common_words(-1) {}
+};
+
+} // namespace DBoW2
+
+#endif
@@ -11,6 +11,9 @@
 #define __D_T_QUERY_RESULTS__
 
 #include <vector>
+#include <algorithm>
+#include <ostream>
+#include <string>
 
 namespace DBoW2 {
 
@@ -112,6 +115,32 @@ public:
     return a.Score > b.Score;
   }
   
+  /**
+   * Compares the score of two results, and their ids if the scores are 
+   * equal, so that any set of results is always sorted in the same order
+   * @param a
+   * @param b
+   * @return true iff a.Score < b.Score, or a.Score == b.Score and 
+   *   a.Id < b.Id
+   */
+  static inline bool ltScoreId(const Result &a, const Result &b)
+  {
+    return a.Score < b.Score || (a.Score == b.Score && a.Id < b.Id);
+  }
+  
+  /**
+   * Compares the score of two results, and their ids if the scores are 
+   * equal, so that any set of results is always sorted in the same order
+   * @param a
+   * @param b
+   * @return true iff a.Score > b.Score, or a.Score == b.Score and 
+   *   a.Id < b.Id
+   */
+  static inline bool gtScoreId(const Result &a, const Result &b)
+  {
+    return a.Score > b.Score || (a.Score == b.Score && a.Id < b.Id);
+  }
+  
   /**
    * Compares the scores of two results
    * @return true iff a.Score > b.Score
@@ -174,6 +203,26 @@ public:
    */
   inline void scaleScores(double factor);
   
+  /**
+   * Adds a result only if it is one of the best max_results results added
+   * so far. The results are kept in a heap whose front is the worst one, 
+   * so sortBest must be called after adding the last result
+   * @param r result to add
+   * @param max_results number of results to keep. <= 0 means all
+   * @param better function such that better(a, b) is true iff a is a
+   *   better result than b (e.g. Result::gt)
+   */
+  template<class Compare>
+  inline void pushBest(const Result &r, int max_results, Compare better);
+  
+  /**
+   * Sorts the results added with pushBest, the best one first
+   * @param max_results same value given to pushBest
+   * @param better same function given to pushBest
+   */
+  template<class Compare>
+  inline void sortBest(int max_results, Compare better);
+  
   /**
    * Prints a string version of the results
    * @param os ostream
@@ -199,6 +248,41 @@ inline void QueryResults::scaleScores(double factor)
 
 // --------------------------------------------------------------------------
 
+template<class Compare>
+inline void QueryResults::pushBest(const Result &r, int max_results, 
+  Compare better)
+{
+  if(max_results <= 0)
+  {
+    push_back(r);
+  }
+  else if((int)size() < max_results)
+  {
+    push_back(r);
+    std::push_heap(begin(), end(), better);
+  }
+  else if(better(r, front()))
+  {
+    // replace the worst result kept
+    std::pop_heap(begin(), end(), better);
+    back() = r;
+    std::push_heap(begin(), end(), better);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class Compare>
+inline void QueryResults::sortBest(int max_results, Compare better)
+{
+  if(max_results <= 0)
+    std::sort(begin(), end(), better);
+  else
+    std::sort_heap(begin(), end(), better);
+}
+
+// --------------------------------------------------------------------------
+
 } // namespace TemplatedBoW
   
 #endif
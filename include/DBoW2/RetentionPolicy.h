@@ -0,0 +1,61 @@
+/**
+ * File: RetentionPolicy.h
+ * Date: October 2026
+ * Description: limits on the entries kept by a database
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_RETENTION_POLICY__
+#define __D_T_RETENTION_POLICY__
+
+#include <cstddef>
+
+namespace DBoW2 {
+
+/// Limits on the entries kept by a database
+/**
+ * When an entry added to a database exceeds any of the limits, the 
+ * oldest entries are erased until the limits are met again, and a few 
+ * inverted rows are compacted, so that the cost of each addition stays 
+ * bounded. A limit of 0 is not applied.
+ */
+class RetentionPolicy
+{
+public:
+
+  /// Maximum number of entries
+  unsigned int max_entries;
+  
+  /// Maximum age of the entries, with respect to the timestamp of the 
+  /// last entry added
+  double max_age;
+  
+  /// Maximum memory used by the entries, in bytes (approximate)
+  size_t max_bytes;
+  
+  /// Number of inverted rows compacted after each addition. 0 means as
+  /// many rows as words the new entry has
+  unsigned int compact_rows;
+
+public:
+
+  /**
+   * Creates a policy without limits
+   */
+  RetentionPolicy(): max_entries(0), max_age(0), max_bytes(0), 
+    compact_rows(0) {}
+  
+  /**
+   * Checks if any limit is set
+   * @return true iff some limit is set
+   */
+  inline bool active() const
+  {
+    return max_entries > 0 || max_age > 0 || max_bytes > 0;
+  }
+};
+
+} // namespace DBoW2
+
+#endif
@@ -0,0 +1,251 @@
+/**
+ * File: ScoreAccumulator.h
+ * Date: October 2026
+ * Description: dense accumulator of entry scores for database queries
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_SCORE_ACCUMULATOR__
+#define __D_T_SCORE_ACCUMULATOR__
+
+#include <vector>
+#include <climits>
+#include "BowVector.h"
+#include "QueryResults.h"
+
+namespace DBoW2 {
+
+/// Accumulates the partial scores of the entries touched by a query
+/**
+ * Scores are stored in dense arrays indexed by entry id, so that adding a
+ * value costs O(1). The ids of the touched entries are kept in a list, so
+ * that the arrays can be reset sparsely between queries. Memory is only
+ * allocated when the number of entries grows, so an accumulator should be
+ * reused across queries.
+ */
+class ScoreAccumulator
+{
+public:
+
+  /**
+   * Creates an empty accumulator
+   */
+  ScoreAccumulator(void);
+
+  /**
+   * Clears the values of the last query and makes room for the given
+   * number of entries
+   * @param n number of entries (entry ids must be < n)
+   * @param with_sums if true, the sums of the query and entry word values
+   *   are accumulated too
+   * @param min_words if > 1, the common words of the entries are counted
+   *   first with count, and then only the entries with at least min_words
+   *   of them are scored by add
+   */
+  void reset(unsigned int n, bool with_sums = false, 
+    unsigned int min_words = 0);
+
+  /**
+   * Counts one common word of an entry, before scoring the entries.
+   * The accumulator must have been reset with min_words > 1
+   * @param id entry id
+   */
+  inline void count(EntryId id);
+
+  /**
+   * Adds a value to the score of an entry and counts one common word. 
+   * If a minimum of common words was given, the entries counted with 
+   * fewer words are ignored
+   * @param id entry id
+   * @param value value to add
+   */
+  inline void add(EntryId id, double value);
+
+  /**
+   * Adds a value to the score of an entry, counts one common word and
+   * accumulates the word values. The accumulator must have been reset 
+   * with sums
+   * @param id entry id
+   * @param value value to add
+   * @param vi value of the word in the query
+   * @param wi value of the word in the entry
+   */
+  inline void add(EntryId id, double value, WordValue vi, WordValue wi);
+
+  /**
+   * Adds values to the scores of some entries, as add does with each one.
+   * Without a minimum of common words, it is faster than adding them one
+   * by one
+   * @param ids entry ids
+   * @param values values to add
+   * @param n number of entries
+   */
+  inline void add(const EntryId *ids, const double *values, unsigned int n);
+
+  /**
+   * Adds values to the scores of some entries and accumulates the word 
+   * values, as add does with each one. The accumulator must have been 
+   * reset with sums
+   * @param ids entry ids
+   * @param values values to add
+   * @param n number of entries
+   * @param vi value of the word in the query
+   * @param wi values of the word in the entries
+   */
+  inline void add(const EntryId *ids, const double *values, unsigned int n,
+    WordValue vi, const WordValue *wi);
+
+  /**
+   * Returns the ids of the entries with some value, in the order they 
+   * were added first
+   * @return entry ids
+   */
+  inline const std::vector<EntryId>& touched() const { return m_touched; }
+
+  /**
+   * Returns the accumulated score of an entry
+   * @param id entry id
+   * @return score
+   */
+  inline double score(EntryId id) const { return m_scores[id]; }
+
+  /**
+   * Returns the number of words an entry has in common with the query
+   * @param id entry id
+   * @return number of common words
+   */
+  inline unsigned int words(EntryId id) const { return m_words[id]; }
+
+  /**
+   * Returns the sum of the query values of the words in common with an
+   * entry
+   * @param id entry id
+   * @return sum of vi
+   */
+  inline double sumVi(EntryId id) const { return m_sum_vi[id]; }
+
+  /**
+   * Returns the sum of the entry values of the words in common with the
+   * query
+   * @param id entry id
+   * @return sum of wi
+   */
+  inline double sumWi(EntryId id) const { return m_sum_wi[id]; }
+
+  /**
+   * Checks if the sums of the word values are accumulated
+   * @return true iff the accumulator was reset with sums
+   */
+  inline bool hasSums() const { return m_with_sums; }
+
+protected:
+
+  /// Scores of entries
+  std::vector<double> m_scores;
+
+  /// Number of common words of entries (0 iff not touched)
+  std::vector<unsigned int> m_words;
+
+  /// Common words counted before scoring, saturated at the maximum value
+  std::vector<unsigned short> m_counts;
+
+  /// Entries counted
+  std::vector<EntryId> m_counted;
+
+  /// Minimum number of common words counted of the entries scored
+  unsigned int m_min_words;
+
+  /// Sums of query and entry values of common words
+  std::vector<double> m_sum_vi, m_sum_wi;
+
+  /// Entries with some value
+  std::vector<EntryId> m_touched;
+
+  /// Whether the sums were accumulated in the last query
+  bool m_with_sums;
+};
+
+// --------------------------------------------------------------------------
+
+inline void ScoreAccumulator::count(EntryId id)
+{
+  unsigned short &c = m_counts[id];
+  if(c == 0) m_counted.push_back(id);
+  if(c < USHRT_MAX) ++c;
+}
+
+// --------------------------------------------------------------------------
+
+inline void ScoreAccumulator::add(EntryId id, double value)
+{
+  if(m_min_words > 1 && m_counts[id] < m_min_words) return;
+  
+  if(m_words[id]++ == 0) m_touched.push_back(id);
+  m_scores[id] += value;
+}
+
+// --------------------------------------------------------------------------
+
+inline void ScoreAccumulator::add(EntryId id, double value, 
+  WordValue vi, WordValue wi)
+{
+  add(id, value);
+  m_sum_vi[id] += vi;
+  m_sum_wi[id] += wi;
+}
+
+// --------------------------------------------------------------------------
+
+inline void ScoreAccumulator::add(const EntryId *ids, const double *values,
+  unsigned int n)
+{
+  if(m_min_words > 1)
+  {
+    for(unsigned int i = 0; i < n; ++i) add(ids[i], values[i]);
+    return;
+  }
+  
+  // the arrays are not read again after each entry
+  double *scores = &m_scores[0];
+  unsigned int *words = &m_words[0];
+  
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    const EntryId id = ids[i];
+    if(words[id]++ == 0) m_touched.push_back(id);
+    scores[id] += values[i];
+  }
+}
+
+// --------------------------------------------------------------------------
+
+inline void ScoreAccumulator::add(const EntryId *ids, const double *values,
+  unsigned int n, WordValue vi, const WordValue *wi)
+{
+  if(m_min_words > 1)
+  {
+    for(unsigned int i = 0; i < n; ++i) add(ids[i], values[i], vi, wi[i]);
+    return;
+  }
+  
+  double *scores = &m_scores[0];
+  unsigned int *words = &m_words[0];
+  double *sum_vi = &m_sum_vi[0];
+  double *sum_wi = &m_sum_wi[0];
+  
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    const EntryId id = ids[i];
+    if(words[id]++ == 0) m_touched.push_back(id);
+    scores[id] += values[i];
+    sum_vi[id] += vi;
+    sum_wi[id] += wi[i];
+  }
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
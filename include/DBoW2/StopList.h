@@ -0,0 +1,74 @@
+/**
+ * File: StopList.h
+ * Date: October 2026
+ * Description: limits on the inverted rows read by database queries
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_STOP_LIST__
+#define __D_T_STOP_LIST__
+
+#include <cstddef>
+
+namespace DBoW2 {
+
+/// Limits on the length of the inverted rows read by queries
+/**
+ * Words that become very common in a database (e.g. the texture of the 
+ * road) have long inverted rows that dominate the query time but add 
+ * little discrimination. Queries skip these rows, or read only a sample of
+ * their postings. A limit of 0 is not applied.
+ */
+class StopList
+{
+public:
+
+  /// Rows with more postings are stop words
+  unsigned int max_postings;
+  
+  /// Rows with more postings than this fraction of the entries of the 
+  /// database are stop words
+  double max_fraction;
+  
+  /// If true, only max_postings (or the fraction) evenly spaced postings 
+  /// of the stop words are read, instead of none
+  bool subsample;
+
+public:
+
+  /**
+   * Creates a stop list without limits
+   */
+  StopList(): max_postings(0), max_fraction(0), subsample(false) {}
+  
+  /**
+   * Checks if any limit is set
+   * @return true iff some limit is set
+   */
+  inline bool active() const
+  {
+    return max_postings > 0 || max_fraction > 0;
+  }
+  
+  /**
+   * Returns the maximum length of the rows that are not stop words
+   * @param nentries number of entries in the database
+   * @return maximum number of postings, or 0 if there is no limit
+   */
+  inline size_t limit(unsigned int nentries) const
+  {
+    size_t n = max_postings;
+    if(max_fraction > 0)
+    {
+      size_t m = (size_t)(max_fraction * nentries);
+      if(m < 1) m = 1;
+      if(n == 0 || m < n) n = m;
+    }
+    return n;
+  }
+};
+
+} // namespace DBoW2
+
+#endif
@@ -14,17 +14,43 @@
 #include <numeric>
 #include <fstream>
 #include <string>
-#include <list>
 #include <set>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <functional>
+#include <cstdint>
+#include <cmath>
 
 #include "TemplatedVocabulary.h"
 #include "QueryResults.h"
 #include "ScoringObject.h"
 #include "BowVector.h"
 #include "FeatureVector.h"
+#include "ScoreAccumulator.h"
+#include "QueryContext.h"
+#include "ConcurrentStorage.h"
+#include "RetentionPolicy.h"
+#include "EntryRange.h"
+#include "StopList.h"
+#include "DeltaCodec.h"
+#include "ThreadPool.h"
 
 #include <DUtils/DUtils.h>
 
+// If DBOW2_POSTING_BITS is 8 or 16, the inverted file stores the weights
+// with that number of bits and a scale per row. 0 or undefined stores them
+// as WordValue
+#if defined(DBOW2_POSTING_BITS) && DBOW2_POSTING_BITS != 0
+#if DBOW2_POSTING_BITS != 8 && DBOW2_POSTING_BITS != 16
+#error "DBOW2_POSTING_BITS must be 0, 8 or 16"
+#endif
+#define DBOW2_QUANTIZED_POSTINGS
+#endif
+
 namespace DBoW2 {
 
 // For query functions
@@ -34,8 +60,38 @@ static int MIN_COMMON_WORDS = 5;
 /// @param F class of descriptor functions
 template<class TDescriptor, class F>
 /// Generic Database
+/**
+ * One thread may add() entries while other threads query() the database,
+ * retrieve their features or save it. Queries do not wait for add() and
+ * see the entries that were complete when they started. The rest of the
+ * non-const functions must not run concurrently with any other one.
+ */
 class TemplatedDatabase
 {
+public:
+
+  /// Keeps valid the data read from the database by the calling thread
+  /**
+   * While a thread adds entries, those erased by a retention policy, or 
+   * by compact(), release their features. A thread that holds a guard can
+   * keep using the features it got with retrieveFeatures, even if they are
+   * released meanwhile. Guards should be short-lived, since the memory 
+   * released while they exist is not freed until they are destroyed
+   */
+  class ReadGuard
+  {
+  public:
+    /**
+     * Registers the calling thread as a reader of the database
+     * @param db
+     */
+    explicit ReadGuard(const TemplatedDatabase<TDescriptor, F> &db)
+      : m_guard(db.m_reclaimer) {}
+    
+  private:
+    MemoryReclaimer::ReadGuard m_guard;
+  };
+
 public:
 
   /**
@@ -59,7 +115,20 @@ public:
     int di_levels = 0);
 
   /**
-   * Copy constructor. Copies the vocabulary too
+   * Creates a database that shares the given vocabulary. The vocabulary is
+   * not copied, so several databases can use the same one
+   * @param T class inherited from TemplatedVocabulary<TDescriptor, F>
+   * @param voc vocabulary to share
+   * @param use_di a direct index is used to store feature indexes
+   * @param di_levels levels to go up the vocabulary tree to select the 
+   *   node id to store in the direct index when adding images
+   */
+  template<class T>
+  explicit TemplatedDatabase(const std::shared_ptr<T> &voc, 
+    bool use_di = true, int di_levels = 0);
+
+  /**
+   * Copy constructor. The vocabulary is shared with db
    * @param db object to copy
    */
   TemplatedDatabase(const TemplatedDatabase<TDescriptor, F> &db);
@@ -82,7 +151,7 @@ public:
   virtual ~TemplatedDatabase(void);
 
   /**
-   * Copies the given database and its vocabulary
+   * Copies the given database. The vocabulary is shared with db
    * @param db database to copy
    */
   TemplatedDatabase<TDescriptor,F>& operator=(
@@ -107,6 +176,28 @@ public:
    */
   template<class T>
   void setVocabulary(const T& voc, bool use_di, int di_levels = 0);
+
+  /**
+   * Sets the vocabulary to share and clears the content of the database.
+   * The vocabulary is not copied
+   * @param T class inherited from TemplatedVocabulary<TDescriptor, F>
+   * @param voc vocabulary to share
+   */
+  template<class T>
+  inline void setVocabulary(const std::shared_ptr<T> &voc);
+
+  /**
+   * Sets the vocabulary to share and the direct index parameters, and
+   * clears the content of the database. The vocabulary is not copied
+   * @param T class inherited from TemplatedVocabulary<TDescriptor, F>
+   * @param voc vocabulary to share
+   * @param use_di a direct index is used to store feature indexes
+   * @param di_levels levels to go up the vocabulary tree to select the 
+   *   node id to store in the direct index when adding images
+   */
+  template<class T>
+  void setVocabulary(const std::shared_ptr<T> &voc, bool use_di, 
+    int di_levels = 0);
   
   /**
    * Returns a pointer to the vocabulary used
@@ -114,10 +205,19 @@ public:
    */
   inline const TemplatedVocabulary<TDescriptor,F>* getVocabulary() const;
 
+  /**
+   * Returns the vocabulary used, so that it can be shared with other
+   * databases
+   * @return vocabulary
+   */
+  inline std::shared_ptr<const TemplatedVocabulary<TDescriptor,F> >
+    getSharedVocabulary() const;
+
   /** 
    * Allocates some memory for the direct and inverted indexes
    * @param nd number of expected image entries in the database 
-   * @param ni number of expected words per image
+   * @param ni number of expected entries per word (capacity reserved in 
+   *   each row of the inverted index)
    * @note Use 0 to ignore a parameter
    */
   void allocate(int nd = 0, int ni = 0);
@@ -127,20 +227,124 @@ public:
    * @param features features of the new entry
    * @param bowvec if given, the bow vector of these features is returned
    * @param fvec if given, the vector of nodes and feature indexes is returned
+   * @param timestamp time of the entry, used by the retention policy
    * @return id of new entry
    */
   EntryId add(const std::vector<TDescriptor> &features,
-    BowVector *bowvec = NULL, FeatureVector *fvec = NULL);
+    BowVector *bowvec = NULL, FeatureVector *fvec = NULL, 
+    double timestamp = 0);
 
   /**
-   * Adss an entry to the database and returns its index
+   * Adss an entry to the database and returns its index. The entry is 
+   * visible to the queries when complete. Only one thread can add entries
+   * at the same time. If a retention policy is set, the oldest entries 
+   * that exceed it are erased and a few rows are compacted afterwards
    * @param vec bow vector
    * @param fec feature vector to add the entry. Only necessary if using the
    *   direct index
+   * @param timestamp time of the entry, used by the retention policy. 
+   *   Entries must be added in non-decreasing timestamp order
    * @return id of new entry
    */
   EntryId add(const BowVector &vec, 
-    const FeatureVector &fec = FeatureVector() );
+    const FeatureVector &fec = FeatureVector(), double timestamp = 0);
+
+  /**
+   * Erases an entry. Queries ignore it from now on, and its id is not 
+   * reused. The memory of its postings and features is freed by compact()
+   * @param id entry id
+   * @return false iff the entry did not exist or was already erased
+   */
+  bool erase(EntryId id);
+  
+  /**
+   * Checks if an entry was erased
+   * @param id entry id (must be < size())
+   * @return true iff the entry was erased
+   */
+  inline bool isErased(EntryId id) const;
+  
+  /**
+   * Removes the postings of the erased entries from the inverted file, and
+   * frees their features once all their postings are gone. Rows are 
+   * replaced while queries may be reading them, so this can be called 
+   * by the thread that adds entries, a few rows at a time, to spread 
+   * the cost. After compaction, the features of the erased entries are 
+   * no longer available.
+   * Without the forward index, every row is rewritten by a sweep that 
+   * compacts the entries erased before it starts. Compacting some rows 
+   * starts a new sweep only when 1/SWEEP_FRACTION of the entries wait 
+   * for one, so that a sweep reads about SWEEP_FRACTION times the 
+   * postings of the entries it compacts. Until then, erased entries keep
+   * their memory unless all the rows are compacted
+   * @param max_rows maximum number of rows to rewrite. <= 0 means all
+   * @return number of rows that remain to be compacted by calls with 
+   *   max_rows > 0
+   */
+  unsigned int compact(int max_rows = 0);
+  
+  /**
+   * Sets whether to keep a forward index with the words of each entry.
+   * With it, compact() only rewrites the rows of the erased entries; 
+   * without it, erased entries are compacted in batches by sweeps of the
+   * whole inverted file. It costs one word id per posting
+   * @param use if true, the forward index is built and kept
+   */
+  void setForwardIndex(bool use);
+  
+  /**
+   * Checks if the forward index is being used
+   * @return true iff using forward index
+   */
+  inline bool usingForwardIndex() const;
+  
+  /**
+   * Sets whether to compress the inverted file. Each row is then stored
+   * as blocks of BLOCK_POSTINGS postings, whose entry ids are encoded as
+   * differences with a variable number of bytes, followed by a tail of 
+   * fewer postings not compressed yet. Blocks are compressed as they are 
+   * completed, and queries skip the blocks out of their range of entries
+   * without decoding them. Enabling it compresses the complete blocks of
+   * all the rows now. Disabling it keeps the existing blocks compressed
+   * @param compress if true, new blocks are compressed
+   */
+  void setCompression(bool compress);
+  
+  /**
+   * Checks if the inverted file is compressed
+   * @return true iff compressing new blocks of postings
+   */
+  inline bool usingCompression() const;
+  
+  /**
+   * Sets the limits on the entries kept. The oldest entries that exceed
+   * them are erased now, and then each time an entry is added. Their 
+   * memory is freed by compacting a few rows after each addition, or by 
+   * calling compact(). The newest entry is never erased
+   * @param policy limits to apply
+   */
+  void setRetention(const RetentionPolicy &policy);
+  
+  /**
+   * Returns the limits on the entries kept
+   * @return retention policy
+   */
+  inline const RetentionPolicy& getRetention() const;
+  
+  /**
+   * Returns the timestamp given when adding an entry
+   * @param id entry id (must be < size())
+   * @return timestamp
+   */
+  inline double getTimestamp(EntryId id) const;
+  
+  /**
+   * Returns the approximate memory used by the postings and features of
+   * the entries not erased. This is the size limited by the retention 
+   * policy
+   * @return bytes
+   */
+  inline size_t getMemoryUsage() const;
 
   /**
    * Empties the database
@@ -165,12 +369,87 @@ public:
    */
   inline int getDirectIndexLevels() const;
   
+  /**
+   * Sets the number of threads a single query can use. The entries are
+   * split among the threads, and the results are the same as those of
+   * one thread. Queries that read few postings always use one thread.
+   * The threads are created by the first query that needs them, and are
+   * kept by the database for the next queries and for queryBatch
+   * @param nthreads number of threads. <= 0 means one per core
+   */
+  void setQueryThreads(int nthreads);
+  
+  /**
+   * Returns the number of threads a single query can use
+   * @return number of threads
+   */
+  inline int getQueryThreads() const;
+  
+  /**
+   * Sets whether queries skip the entries that cannot be among the best 
+   * results (MaxScore pruning). Words are scored in decreasing order of 
+   * their maximum contribution. Once the remaining words cannot lift a 
+   * new entry into the best results, only the candidates found so far are
+   * looked up in the rest of the rows, and those that cannot reach the 
+   * best results are dropped. The results are the same as without 
+   * pruning, but for rounding errors in the scores. Only L1, L2 and dot 
+   * product scoring are pruned, and only in queries that return a limited
+   * number of results. queryBatch is never pruned
+   * @param prune if true, queries are pruned
+   */
+  void setQueryPruning(bool prune);
+  
+  /**
+   * Checks if queries are pruned
+   * @return true iff pruning queries
+   */
+  inline bool usingQueryPruning() const;
+  
+  /**
+   * Sets the limits on the inverted rows read by queries. The words whose
+   * rows are longer are stop words: queries skip them, as if they were 
+   * not in the query vector, or read only a sample of their postings. 
+   * The length of a row counts the postings of the entries not compacted
+   * yet. queryBatch applies the stop list too, but does not report the 
+   * postings skipped
+   * @param stop stop list
+   */
+  void setStopList(const StopList &stop);
+  
+  /**
+   * Returns the limits on the inverted rows read by queries
+   * @return stop list
+   */
+  inline const StopList& getStopList() const;
+  
+  /**
+   * Sets the minimum number of words an entry must have in common with a
+   * query to be among its results. Queries count the common words of the
+   * entries first, with small counters, and then score only the entries 
+   * with enough of them. The stop words skipped are not counted. This is
+   * the default of the queries that do not set their own minimum (with
+   * QueryContext::min_common_words), and it can be changed while queries 
+   * run
+   * @param n minimum number of common words. A negative value restores 
+   *   the default: MIN_COMMON_WORDS for chi-square and Bhattacharyya 
+   *   scoring, checked after scoring all the entries without counting 
+   *   them first, and no minimum for the rest
+   */
+  void setMinCommonWords(int n);
+  
+  /**
+   * Returns the minimum number of words the results of queries that do 
+   * not set their own have in common with them
+   * @return minimum number of common words
+   */
+  inline int getMinCommonWords() const;
+  
   /**
    * Queries the database with some features
    * @param features query features
    * @param ret (out) query results
    * @param max_results number of results to return. <= 0 means all
-   * @param max_id only entries with id <= max_id are returned in ret. 
+   * @param max_id only entries with id < max_id are returned in ret. 
    *   < 0 means all
    */
   void query(const std::vector<TDescriptor> &features, QueryResults &ret,
@@ -181,14 +460,127 @@ public:
    * @param vec bow vector already normalized
    * @param ret results
    * @param max_results number of results to return. <= 0 means all
-   * @param max_id only entries with id <= max_id are returned in ret. 
+   * @param max_id only entries with id < max_id are returned in ret. 
    *   < 0 means all
    */
   void query(const BowVector &vec, QueryResults &ret, 
     int max_results = 1, int max_id = -1) const;
 
   /**
-   * Returns the a feature vector associated with a database entry
+   * Queries the database with some features, using the scratch memory of
+   * the given context. A context reused across queries avoids allocating
+   * memory in each one
+   * @param features query features
+   * @param ret (out) query results
+   * @param ctx context for this query
+   * @param max_results number of results to return. <= 0 means all
+   * @param max_id only entries with id < max_id are returned in ret. 
+   *   < 0 means all
+   */
+  void query(const std::vector<TDescriptor> &features, QueryResults &ret,
+    QueryContext &ctx, int max_results = 1, int max_id = -1) const;
+
+  /**
+   * Queries the database with a vector, using the scratch memory of the
+   * given context. A context reused across queries avoids allocating
+   * memory in each one
+   * @param vec bow vector already normalized
+   * @param ret results
+   * @param ctx context for this query
+   * @param max_results number of results to return. <= 0 means all
+   * @param max_id only entries with id < max_id are returned in ret. 
+   *   < 0 means all
+   */
+  void query(const BowVector &vec, QueryResults &ret, QueryContext &ctx,
+    int max_results = 1, int max_id = -1) const;
+  
+  /**
+   * Queries the database with some features, only among the entries of
+   * the given range
+   * @param features query features
+   * @param ret (out) query results
+   * @param range entries to consider
+   * @param max_results number of results to return. <= 0 means all
+   */
+  void query(const std::vector<TDescriptor> &features, QueryResults &ret,
+    const EntryRange &range, int max_results = 1) const;
+  
+  /**
+   * Queries the database with a vector, only among the entries of the 
+   * given range
+   * @param vec bow vector already normalized
+   * @param ret (out) query results
+   * @param range entries to consider
+   * @param max_results number of results to return. <= 0 means all
+   */
+  void query(const BowVector &vec, QueryResults &ret, 
+    const EntryRange &range, int max_results = 1) const;
+  
+  /**
+   * Queries the database with some features, only among the entries of
+   * the given range, using the scratch memory of the given context
+   * @param features query features
+   * @param ret (out) query results
+   * @param ctx context for this query
+   * @param range entries to consider
+   * @param max_results number of results to return. <= 0 means all
+   */
+  void query(const std::vector<TDescriptor> &features, QueryResults &ret,
+    QueryContext &ctx, const EntryRange &range, int max_results = 1) const;
+  
+  /**
+   * Queries the database with a vector, only among the entries of the 
+   * given range, using the scratch memory of the given context
+   * @param vec bow vector already normalized
+   * @param ret (out) query results
+   * @param ctx context for this query
+   * @param range entries to consider
+   * @param max_results number of results to return. <= 0 means all
+   */
+  void query(const BowVector &vec, QueryResults &ret, QueryContext &ctx,
+    const EntryRange &range, int max_results = 1) const;
+
+  /**
+   * Queries the database with many vectors at once. The queries are 
+   * processed in small batches, and the inverted row of each word is read
+   * once for all the queries of a batch that contain it. Batches are run
+   * in parallel. Results are the same as those of query()
+   * @param vecs bow vectors already normalized
+   * @param rets (out) results of each query
+   * @param max_results number of results to return per query. <= 0 means
+   *   all
+   * @param max_id only entries with id < max_id are returned in ret. 
+   *   < 0 means all
+   * @param nthreads number of threads to use. <= 0 means one per core
+   * @param min_common_words minimum number of words the results must have
+   *   in common with their query. < 0 means the minimum of the database
+   *   (see setMinCommonWords)
+   */
+  void queryBatch(const std::vector<BowVector> &vecs, 
+    std::vector<QueryResults> &rets, int max_results = 1, int max_id = -1,
+    int nthreads = 0, int min_common_words = -1) const;
+  
+  /**
+   * Queries the database with many vectors at once, only among the 
+   * entries of the given range. See queryBatch above
+   * @param vecs bow vectors already normalized
+   * @param rets (out) results of each query
+   * @param range entries to consider
+   * @param max_results number of results to return per query. <= 0 means
+   *   all
+   * @param nthreads number of threads to use. <= 0 means one per core
+   * @param min_common_words minimum number of common words of the 
+   *   results. < 0 means the minimum of the database
+   */
+  void queryBatch(const std::vector<BowVector> &vecs, 
+    std::vector<QueryResults> &rets, const EntryRange &range, 
+    int max_results = 1, int nthreads = 0, int min_common_words = -1) const;
+
+  /**
+   * Returns the a feature vector associated with a database entry. It is
+   * empty once the entry is erased and compacted. If another thread may 
+   * compact entries meanwhile (with add and a retention policy, or with
+   * compact), the caller must hold a ReadGuard while using the reference
    * @param id entry id (must be < size())
    * @return const reference to map of nodes and their associated features in
    *   the given entry
@@ -216,51 +608,171 @@ public:
     const std::string &name = "database") const;
   
   /** 
-   * Loads the database from the given file storage structure
+   * Loads the database from the given file storage structure. The 
+   * vocabulary is loaded into a new TemplatedVocabulary, since the current
+   * one may be shared, so that a vocabulary of a derived class is not kept
    * @param fs
    * @param name node name
    */
   virtual void load(const cv::FileStorage &fs, 
     const std::string &name = "database");
+  
+  /** 
+   * Loads the database from the given file storage structure, reading the
+   * vocabulary into the given one, which the database keeps. This keeps
+   * the class of a vocabulary derived from TemplatedVocabulary
+   * @param fs
+   * @param voc vocabulary to load, not shared with other databases yet
+   * @param name node name
+   */
+  template<class T>
+  void load(const cv::FileStorage &fs, const std::shared_ptr<T> &voc,
+    const std::string &name = "database");
 
 protected:
+
+  /**
+   * Loads the entries of the database, once the vocabulary is loaded
+   * @param fs
+   * @param name node name
+   */
+  void loadEntries(const cv::FileStorage &fs, const std::string &name);
+
+  /// Function that compares two results
+  typedef bool (*ResultOrder)(const Result &, const Result &);
+
+  /**
+   * Returns the context used by the queries of the calling thread that
+   * are not given one
+   * @return context of this thread
+   */
+  static QueryContext& threadContext();
+  
+  /**
+   * Returns the number of threads to use for a query. Small queries are
+   * run on one thread
+   * @param vec query vector
+   * @param nids number of entries the query considers
+   * @return number of threads
+   */
+  int queryThreads(const BowVector &vec, int nids) const;
+  
+  /**
+   * Returns the function that sorts the results of a query before they 
+   * are completed, the best one first
+   * @return comparison function
+   */
+  inline ResultOrder resultOrder() const;
   
-  /// Query with L1 scoring
-  void queryL1(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+  /**
+   * Adds to some results the best entries of the given scores
+   * @param vec query vector
+   * @param acc scores accumulated from the inverted file
+   * @param ret (in/out) results, kept by QueryResults::pushBest
+   * @param max_results number of results to return. <= 0 means all
+   * @param steps step to read the row of each word of vec, or empty
+   * @param min_words minimum number of common words (< 0: default of the
+   *   scoring)
+   */
+  void select(const BowVector &vec, const ScoreAccumulator &acc,
+    QueryResults &ret, int max_results, 
+    const std::vector<unsigned int> &steps, int min_words) const;
   
-  /// Query with L2 scoring
-  void queryL2(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+  /**
+   * Returns the minimum number of common words of the results
+   * @param n minimum given to the query or set in the database
+   * @return n, or the default of the scoring if n < 0
+   */
+  inline int minCommonWords(int n) const;
   
-  /// Query with Chi square scoring
-  void queryChiSquare(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+  /**
+   * Sorts the selected results and completes their scores
+   * @param ret (in/out) results
+   * @param max_results same value given to select
+   */
+  void finish(QueryResults &ret, int max_results) const;
   
-  /// Query with Bhattacharyya scoring
-  void queryBhattacharyya(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+  /**
+   * Scores one of the parts of the entries of a query run on several
+   * threads
+   * @param vec query vector
+   * @param ctx context of the query. Part t > 0 uses its thread_scores[t]
+   *   and thread_results[t]
+   * @param ret (out) results of part 0
+   * @param max_results number of results to return. <= 0 means all
+   * @param first_id first entry id of the query
+   * @param last_id end of the entries of the query
+   * @param min_words minimum number of common words (< 0: default)
+   * @param nparts number of parts
+   * @param t part to score
+   */
+  void queryPart(const BowVector &vec, QueryContext &ctx, QueryResults &ret,
+    int max_results, int first_id, int last_id, int min_words, int nparts,
+    unsigned int t) const;
   
-  /// Query with KL divergence scoring  
-  void queryKL(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+  /**
+   * Scores the entries of a range of ids and selects the best ones
+   * @param vec query vector
+   * @param acc accumulator for the scores
+   * @param ret (out) results, not sorted until finish is called
+   * @param max_results number of results to return. <= 0 means all
+   * @param first_id first entry id of the range
+   * @param last_id end of the range
+   * @param steps step to read the row of each word of vec, or empty
+   * @param min_words minimum number of common words (< 0: default)
+   */
+  void queryRange(const BowVector &vec, ScoreAccumulator &acc, 
+    QueryResults &ret, int max_results, int first_id, int last_id,
+    const std::vector<unsigned int> &steps, int min_words) const;
   
-  /// Query with dot product scoring
-  void queryDotProduct(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+  /**
+   * Runs the batches of queryBatch that are not taken by other threads
+   * @param vecs query vectors
+   * @param rets (out) results
+   * @param max_results number of results per query
+   * @param first_id first entry id considered
+   * @param last_id entries with id >= last_id are ignored
+   * @param nentries number of entries seen by the queries
+   * @param min_words minimum number of common words (< 0: default)
+   * @param next_batch index of the next batch to run
+   */
+  void queryBatches(const std::vector<BowVector> &vecs, 
+    std::vector<QueryResults> &rets, int max_results, int first_id,
+    int last_id, int nentries, int min_words, 
+    std::atomic<int> &next_batch) const;
+
 
 protected:
 
   /* Inverted file declaration */
   
+#ifdef DBOW2_QUANTIZED_POSTINGS
+  /// Word weight of a posting, in units of the scale of its row
+#if DBOW2_POSTING_BITS == 8
+  typedef int8_t PostingCode;
+#else
+  typedef int16_t PostingCode;
+#endif
+  
+  /// Greatest absolute value of a PostingCode
+  static const int MAX_POSTING_CODE = (1 << (DBOW2_POSTING_BITS - 1)) - 1;
+  
+  // postings are packed, since their size is most of the inverted file
+#pragma pack(push, 1)
+#else
+  /// Word weight of a posting
+  typedef WordValue PostingCode;
+#endif
+  
   /// Item of IFRow
   struct IFPair
   {
     /// Entry id
     EntryId entry_id;
     
-    /// Word weight in this entry
-    WordValue word_weight;
+    /// Word weight in this entry, stored as given by postingValue and
+    /// quantized with the scale of the row (see quantize)
+    PostingCode word_weight;
     
     /**
      * Creates an empty pair
@@ -270,9 +782,9 @@ protected:
     /**
      * Creates an inverted file pair
      * @param eid entry id
-     * @param wv word weight
+     * @param wv word weight code
      */
-    IFPair(EntryId eid, WordValue wv): entry_id(eid), word_weight(wv) {}
+    IFPair(EntryId eid, PostingCode wv): entry_id(eid), word_weight(wv) {}
     
     /**
      * Compares the entry ids
@@ -280,839 +792,3388 @@ protected:
      * @return true iff this entry id is the same as eid
      */
     inline bool operator==(EntryId eid) const { return entry_id == eid; }
+    
+    /**
+     * Compares the entry ids
+     * @param eid
+     * @return true iff this entry id is lower than eid
+     */
+    inline bool operator<(EntryId eid) const { return entry_id < eid; }
   };
   
-  /// Row of InvertedFile
-  typedef std::list<IFPair> IFRow;
-  // IFRows are sorted in ascending entry_id order
+#ifdef DBOW2_QUANTIZED_POSTINGS
+#pragma pack(pop)
+#endif
+  
+  /// Row of InvertedFile, with the scale of its weights as header
+  typedef PublishedArray<IFPair, WordValue> IFRow;
+  // IFRows are sorted in ascending entry_id order and stored contiguously.
+  // Readers must take a snapshot of a row while registered in m_reclaimer.
+  // The scale is 0 until a weight other than 0 is added, and always 0 if
+  // the postings are not quantized
   
   /// Inverted index
   typedef std::vector<IFRow> InvertedFile; 
   // InvertedFile[word_id] --> inverted file of that word
   
+  /// Upper bound of the weights of a block of postings of a row
+  struct BlockBound
+  {
+    /// Entry id of the last posting of the block
+    EntryId last_id;
+    
+    /// Maximum absolute weight of the postings of the block
+    WordValue max_weight;
+    
+    /**
+     * Creates an empty bound
+     */
+    BlockBound(){}
+    
+    /**
+     * Creates the bound of a block
+     * @param id entry id of the last posting of the block
+     * @param w maximum absolute weight
+     */
+    BlockBound(EntryId id, WordValue w): last_id(id), max_weight(w) {}
+  };
+  
+  /// Bounds of the blocks of an IFRow
+  typedef PublishedArray<BlockBound> BlockRow;
+  // The i-th block has the postings with entry_id in 
+  // (BlockRow[i-1].last_id, BlockRow[i].last_id]. Bounds are kept by entry
+  // id, so they remain valid while erased postings are removed. The 
+  // postings after the last block are bounded by the row maximum
+  
+  /// Header of a block of CompressedRow
+  struct CompressedBlock
+  {
+    /// Entry ids of the first and last postings of the block
+    EntryId first_id, last_id;
+    
+    /// Bytes of the block, header included, to skip it
+    unsigned int bytes;
+    
+    /// Number of postings
+    unsigned short count;
+    
+    /// Bytes of the entry ids encoded with DeltaCodec
+    unsigned short id_bytes;
+    
+    /// Scale of the weights of the postings (see IFRow)
+    WordValue scale;
+  };
+  
+  /// Compressed postings of a row of InvertedFile, with the version of
+  /// its blocks
+  typedef PublishedArray<unsigned char, unsigned int> CompressedRow;
+  // A CompressedRow is a sequence of blocks, each one made of its 
+  // CompressedBlock header, the entry ids but the first one encoded with 
+  // DeltaCodec, and the weight codes of the postings. Blocks are sorted 
+  // by entry id and precede the postings of the IFRow of the same word, 
+  // which is then the uncompressed tail of the row. Each block is also a
+  // block of BlockRow
+  
+  /// Entry of the index of a CompressedRow
+  struct BlockEntry
+  {
+    /// Entry ids of the first and last postings of the block
+    EntryId first_id, last_id;
+    
+    /// Offset of the block in the CompressedRow
+    unsigned int offset;
+    
+    /// Number of postings of the row up to the end of the block
+    unsigned int postings;
+  };
+  
+  /// Index of the blocks of a CompressedRow, with their version
+  typedef PublishedArray<BlockEntry, unsigned int> BlockIndex;
+  // BlockIndex[i] locates the i-th block of the CompressedRow of the same
+  // word, so that readers find the blocks of a range of entries by binary
+  // search. New blocks are appended to the CompressedRow before the 
+  // index. When the blocks are encoded again, both get a new version, so
+  // readers can tell if the index they got is not that of the blocks
+  
   /* Direct file declaration */
 
-  /// Direct index
-  typedef std::vector<FeatureVector> DirectFile;
+  /// Direct index. Features are replaced while being read by other threads
+  typedef SegmentedArray<PublishedValue<FeatureVector> > DirectFile;
   // DirectFile[entry_id] --> [ directentry, ... ]
-
-protected:
-
-  /// Associated vocabulary
-  TemplatedVocabulary<TDescriptor, F> *m_voc;
-  
-  /// Flag to use direct index
-  bool m_use_di;
   
-  /// Levels to go up the vocabulary tree to select nodes to store
-  /// in the direct index
-  int m_dilevels;
+  /* Retention declaration */
   
-  /// Inverted file (must have size() == |words|)
-  InvertedFile m_ifile;
+  /// Data of an entry used by the retention policy
+  struct EntryInfo
+  {
+    /// Time given when adding the entry
+    double timestamp;
+    
+    /// Approximate memory of its postings and features
+    size_t bytes;
+    
+    /**
+     * Creates an empty item
+     */
+    EntryInfo(): timestamp(0), bytes(0) {}
+  };
   
-  /// Direct file (resized for allocation)
-  DirectFile m_dfile;
+  /* Scoring declaration */
   
-  /// Number of valid entries in m_dfile
-  int m_nentries;
+  /// Word of a query whose postings are added to the query scores
+  struct WordQuery
+  {
+    /// Word value in the query
+    WordValue value;
+    
+    /// Scores of the query
+    ScoreAccumulator *acc;
+    
+    /**
+     * Creates an empty item
+     */
+    WordQuery(){}
+    
+    /**
+     * Creates a word of a query
+     * @param v word value
+     * @param a query scores
+     */
+    WordQuery(WordValue v, ScoreAccumulator *a): value(v), acc(a) {}
+  };
   
-};
-
+  /// Word of a query of a batch
+  struct BatchWord
+  {
+    /// Word id
+    WordId word_id;
+    
+    /// Index of the query in the batch
+    unsigned int query;
+    
+    /// Word value in the query
+    WordValue value;
+    
+    /**
+     * Creates an empty item
+     */
+    BatchWord(){}
+    
+    /**
+     * Creates a word of a query
+     * @param wid word id
+     * @param q query index
+     * @param v word value
+     */
+    BatchWord(WordId wid, unsigned int q, WordValue v)
+      : word_id(wid), query(q), value(v) {}
+    
+    /**
+     * Sorts by word and query
+     * @param w
+     * @return true iff this goes before w
+     */
+    inline bool operator<(const BatchWord &w) const
+    {
+      return word_id < w.word_id || (word_id == w.word_id && query < w.query);
+    }
+  };
+  
+  /// Scratch memory of the batches of queryBatch run by a thread
+  struct BatchContext
+  {
+    /// Contexts of the queries of a batch
+    std::vector<QueryContext> queries;
+    
+    /// Words of the queries of a batch
+    std::vector<BatchWord> words;
+    
+    /// Queries of a batch that contain a word
+    std::vector<WordQuery> group;
+  };
+  
+  /**
+   * Returns the context used by the batches of queryBatch run by the 
+   * calling thread. The threads of m_workers are kept, so that their 
+   * contexts are reused by the next calls
+   * @return context of this thread
+   */
+  static BatchContext& threadBatchContext();
+  
+  /// Query run on several threads by m_workers, which are given a
+  /// reference to it, so that starting it does not allocate memory
+  struct PartJob
+  {
+    /// Database
+    const TemplatedDatabase *db;
+    /// Query vector
+    const BowVector *vec;
+    /// Context of the query
+    QueryContext *ctx;
+    /// Results of the query
+    QueryResults *ret;
+    /// Arguments of queryPart
+    int max_results, first_id, last_id, min_words, nparts;
+    
+    /**
+     * Scores a part of the query
+     * @param t part
+     */
+    inline void operator()(unsigned int t) const
+    {
+      db->queryPart(*vec, *ctx, *ret, max_results, first_id, last_id, 
+        min_words, nparts, t);
+    }
+  };
+  
+  /// Call to queryBatch run by m_workers, which are given a reference to
+  /// it, so that starting it does not allocate memory
+  struct BatchJob
+  {
+    /// Database
+    const TemplatedDatabase *db;
+    /// Query vectors
+    const std::vector<BowVector> *vecs;
+    /// Results of the queries
+    std::vector<QueryResults> *rets;
+    /// Arguments of queryBatches
+    int max_results, first_id, last_id, nentries, min_words;
+    /// Index of the next batch to run
+    std::atomic<int> next_batch;
+    
+    /**
+     * Runs the batches that are not taken by other threads (the index of
+     * the task is not used)
+     */
+    inline void operator()(unsigned int)
+    {
+      db->queryBatches(*vecs, *rets, max_results, first_id, last_id, 
+        nentries, min_words, next_batch);
+    }
+  };
+  
+  /// Word of a pruned query
+  struct PrunedWord
+  {
+    /// Word id
+    WordId word_id;
+    
+    /// Word value in the query
+    WordValue value;
+    
+    /// Maximum gain of an entry with this word
+    double bound;
+    
+    /// Step to read the postings of the row (> 0)
+    unsigned int step;
+    
+    /**
+     * Creates an empty item
+     */
+    PrunedWord(){}
+    
+    /**
+     * Creates a word of a query
+     * @param wid word id
+     * @param v word value
+     * @param b maximum gain
+     * @param s step to read the row
+     */
+    PrunedWord(WordId wid, WordValue v, double b, unsigned int s)
+      : word_id(wid), value(v), bound(b), step(s) {}
+    
+    /**
+     * Sorts by decreasing bound, and then by word
+     * @param w
+     * @return true iff this goes before w
+     */
+    inline bool operator<(const PrunedWord &w) const
+    {
+      return bound > w.bound || (bound == w.bound && word_id < w.word_id);
+    }
+  };
+  
+  // Kernels add the contribution of a posting with entry value d of a word
+  // with query value q to the score of an entry, which is given by value. 
+  // Scores are computed so that only the words in common must be 
+  // considered (Nister, 2006), and completed when the results are 
+  // finished.
+  // The kernels that can be pruned also convert a score into a gain, that 
+  // is never negative and grows with each word, and bound the gain of a 
+  // word given the maximum absolute weight of its postings
+  
+  /// L1 posting contribution
+  struct L1Kernel
+  {
+    static inline double value(WordValue q, WordValue d)
+    {
+      return fabs(q - d) - fabs(q) - fabs(d);
+    }
+    
+    static inline void add(ScoreAccumulator &acc, EntryId id, 
+      WordValue q, WordValue d)
+    {
+      acc.add(id, value(q, d));
+    }
+    
+    static inline double gain(double score) { return -score; }
+    
+    static inline double bound(WordValue q, WordValue dmax)
+    {
+      // |q| + |d| - |q - d| <= 2 min(|q|, |d|)
+      return 2 * std::min((WordValue)fabs(q), dmax);
+    }
+  };
+  
+  /// L2 posting contribution
+  struct L2Kernel
+  {
+    static inline double value(WordValue q, WordValue d)
+    {
+      return - q * d; // minus sign for sorting trick
+    }
+    
+    static inline void add(ScoreAccumulator &acc, EntryId id, 
+      WordValue q, WordValue d)
+    {
+      acc.add(id, value(q, d));
+    }
+    
+    static inline double gain(double score) { return -score; }
+    
+    static inline double bound(WordValue q, WordValue dmax)
+    {
+      return fabs(q) * dmax;
+    }
+  };
+  
+  /// Chi square posting contribution
+  struct ChiSquareKernel
+  {
+    static inline double value(WordValue q, WordValue d)
+    {
+      // (v-w)^2/(v+w) - v - w = -4 vw/(v+w)
+      // we move the 4 out
+      const double sum = q + d;
+      return sum != 0.0 ? - q * d / sum : 0.0; // words may have weight zero
+    }
+    
+    static inline void add(ScoreAccumulator &acc, EntryId id, 
+      WordValue q, WordValue d)
+    {
+      acc.add(id, value(q, d), q, d);
+    }
+  };
+  
+  /// KL divergence posting contribution
+  /// The score of an entry starts with the penalty of all the query words
+  /// as if they were missing, q * (log(q) - log(eps)), which is added when
+  /// selecting the results, so a common word replaces its penalty with its
+  /// own term: q * log(q/w) - q * (log(q) - log(eps)) = q * (log(eps) - 
+  /// log(w)). Postings store d = log(w), and a posting with w = 0 (d = 
+  /// -infinity) removes the penalty only. Quantized postings store w, 
+  /// since log(w) is not bounded, and only the weights 0 have code 0 
+  /// (see nonZeroCodes)
+  struct KLKernel
+  {
+    static inline double value(WordValue q, WordValue d)
+    {
+#ifdef DBOW2_QUANTIZED_POSTINGS
+      d = (d > 0 ? log(d) : -std::numeric_limits<WordValue>::infinity());
+#endif
+      double value = 0;
+      if(q != 0) 
+      {
+        if(d > -std::numeric_limits<WordValue>::infinity()) 
+          value = q * (GeneralScoring::LOG_EPS - d);
+        else 
+          value = - q * (log(q) - GeneralScoring::LOG_EPS);
+      }
+      
+      return value;
+    }
+    
+    static inline void add(ScoreAccumulator &acc, EntryId id, 
+      WordValue q, WordValue d)
+    {
+      acc.add(id, value(q, d));
+    }
+  };
+  
+  /// Dot product posting contribution. Bhattacharyya scoring uses it too,
+  /// since sqrt(q * w) = sqrt(q) * sqrt(w) and postings store sqrt(w)
+  struct DotProductKernel
+  {
+    static inline double value(WordValue q, WordValue d)
+    {
+      return q * d;
+    }
+    
+    static inline void add(ScoreAccumulator &acc, EntryId id, 
+      WordValue q, WordValue d)
+    {
+      acc.add(id, value(q, d));
+    }
+    
+    static inline double gain(double score) { return score; }
+    
+    static inline double bound(WordValue q, WordValue dmax)
+    {
+      return fabs(q) * dmax;
+    }
+  };
+  
+  /// Dot product posting contribution with binary weighting
+  struct BinaryDotProductKernel
+  {
+    static inline double value(WordValue, WordValue)
+    {
+      return 1;
+    }
+    
+    static inline void add(ScoreAccumulator &acc, EntryId id, 
+      WordValue q, WordValue d)
+    {
+      acc.add(id, value(q, d));
+    }
+    
+    static inline double gain(double score) { return score; }
+    
+    static inline double bound(WordValue, WordValue) { return 1; }
+  };
+  
+  /// Number of queries of a batch of queryBatch
+  static const int BATCH_QUERIES = 16;
+  
+  /// Minimum number of postings a query must read per thread to run on
+  /// several threads. Scoring this many takes over 100 us, which is about
+  /// twice the work that pays off waking the workers and merging their
+  /// results
+  static const int PARALLEL_QUERY_POSTINGS = 8192;
+  
+  /// Number of postings of each block of BlockRow
+  static const int BLOCK_POSTINGS = 128;
+  
+  /// Cost of looking up a candidate in a row of a pruned query, relative
+  /// to scanning a posting
+  static const int CANDIDATE_LOOKUP_COST = 4;
+  
+  /// Without the forward index, a sweep of all the rows is started by 
+  /// compact(max_rows > 0) once 1/SWEEP_FRACTION of the entries that are
+  /// not erased wait for it
+  static const int SWEEP_FRACTION = 8;
+  
+  /// Reads the postings of a row whose entry ids are in a range
+  /**
+   * The postings are read in segments that are contiguous in memory and
+   * have the same scale: each compressed block, decoded when it is 
+   * reached, and then the tail. The blocks of the range are found in the
+   * BlockIndex by binary search. Readers but the writer must be 
+   * registered in m_reclaimer
+   */
+  class RowReader
+  {
+  public:
+    
+    /// Postings of a segment: the pairs of the tail, or the entry ids and
+    /// the codes of a compressed block, which are not copied into pairs
+    struct Segment
+    {
+      /// Postings of the tail, or NULL if the segment is a block
+      const IFPair *pairs;
+      
+      /// Entry ids of a block
+      const EntryId *ids;
+      
+      /// Codes of the postings of a block, not aligned
+      const unsigned char *codes;
+      
+      /// Number of postings
+      unsigned int size;
+      
+      /// Scale of the codes
+      WordValue scale;
+      
+      /**
+       * Returns the code of a posting of a block
+       * @param i index of the posting in the segment
+       * @return code
+       */
+      inline PostingCode code(unsigned int i) const
+      {
+        PostingCode c;
+        memcpy(&c, codes + i * sizeof(PostingCode), sizeof(PostingCode));
+        return c;
+      }
+    };
+    
+    /**
+     * Starts reading a row
+     * @param db database
+     * @param word_id row
+     * @param first_id first entry id of the range
+     * @param last_id end of the range
+     */
+    RowReader(const TemplatedDatabase &db, WordId word_id, 
+      EntryId first_id, EntryId last_id);
+    
+    /**
+     * Gets the next segment of postings
+     * @param seg (out) postings, valid until the next call
+     * @param min_id the blocks whose postings are all below this id are
+     *   skipped without decoding them
+     * @return false iff there are no more postings
+     */
+    bool next(typename IFRow::Snapshot &seg, EntryId min_id = 0);
+    
+    /**
+     * Gets the next segment of postings like next, but the postings of the
+     * compressed blocks are read from the ids decoded and the codes of the
+     * block, which is faster when they are scanned
+     * @param seg (out) postings, valid until the next call
+     * @param min_id the blocks whose postings are all below this id are
+     *   skipped without decoding them
+     * @return false iff there are no more postings
+     */
+    bool next(Segment &seg, EntryId min_id = 0);
+    
+    /**
+     * Returns the number of postings in the range. The complete blocks
+     * are counted through the index, and the ids of the blocks at the ends
+     * of the range are decoded the first time it is called, unless the 
+     * row has already been read. Segments got before remain valid
+     * @return number of postings
+     */
+    size_t size();
+    
+    /**
+     * Returns the first posting of the last segment that is read when 
+     * reading one posting every step, counting from the first posting of
+     * the range. No block must have been skipped with min_id
+     * @param step distance between the postings read
+     * @return position in the segment
+     */
+    inline unsigned int start(unsigned int step) const
+      { return (unsigned int)((step - m_position % step) % step); }
+    
+    /**
+     * Checks if the last segment is the tail of the row
+     * @return true iff reading the tail
+     */
+    inline bool inTail() const { return m_in_tail; }
+    
+  protected:
+    
+    /**
+     * Decodes the entry ids of a block into m_ids, unless they are there
+     * @param block entry of the block in the index
+     * @param h (out) header of the block
+     */
+    void decodeIds(typename BlockIndex::const_iterator block, 
+      CompressedBlock &h);
+    
+    /**
+     * Compares the last entry id of a block with an entry id
+     * @param b block
+     * @param id
+     * @return true iff all the postings of b are below id
+     */
+    static inline bool endsBefore(const BlockEntry &b, EntryId id)
+      { return b.last_id < id; }
+    
+    /**
+     * Compares the first entry id of a block with an entry id
+     * @param b block
+     * @param id
+     * @return true iff some posting of b is below id
+     */
+    static inline bool startsBefore(const BlockEntry &b, EntryId id)
+      { return b.first_id < id; }
+    
+  protected:
+    
+    /// Tail, without the postings already compressed
+    typename IFRow::Snapshot m_tail;
+    
+    /// Index of the compressed blocks
+    typename BlockIndex::Snapshot m_index;
+    
+    /// Compressed blocks
+    typename CompressedRow::Snapshot m_data;
+    
+    /// Blocks with postings in the range, and next block to read
+    typename BlockIndex::const_iterator m_begin, m_end, m_next;
+    
+    /// Block whose entry ids are in m_ids, if any
+    typename BlockIndex::const_iterator m_ids_block;
+    
+    /// Range of entry ids
+    EntryId m_first_id, m_last_id;
+    
+    /// Postings in the range, and before the last segment
+    size_t m_size, m_position;
+    
+    /// Size of the last segment
+    unsigned int m_last_size;
+    
+    /// Whether the last segment is the tail, and if it was read
+    bool m_in_tail, m_tail_read;
+    
+    /// Whether m_size is known, and if some block was skipped by next
+    bool m_counted, m_skipped;
+    
+    /// Entry ids of a block, with room for decoding whole groups (see 
+    /// DeltaCodec::decode)
+    EntryId m_ids[BLOCK_POSTINGS + 3];
+    
+    /// Postings of the last block read as pairs
+    IFPair m_buf[BLOCK_POSTINGS];
+  };
+
+protected:
+
+  /**
+   * Returns the postings of a row whose entry ids are in a range. Since 
+   * rows are sorted by entry id, the bounds are found by binary search
+   * only when the range does not include the ends of the row
+   * @param row row of the inverted file
+   * @param first_id first entry id of the range
+   * @param last_id end of the range
+   * @return postings in [first_id, last_id)
+   */
+  static inline typename IFRow::Snapshot clipRow(
+    const typename IFRow::Snapshot &row, EntryId first_id, EntryId last_id);
+  
+  /**
+   * Returns the value stored in the postings for a word weight, so that 
+   * the part of the scoring that depends on the entry only is computed 
+   * when the entry is added: sqrt(w) for Bhattacharyya, log(w) for KL and
+   * w for the rest
+   * @param w word weight
+   * @return posting value
+   */
+  inline WordValue postingValue(WordValue w) const;
+  
+  /**
+   * Returns the word weight of a posting value. Inverse of postingValue
+   * @param d posting value
+   * @return word weight
+   */
+  inline WordValue postingWeight(WordValue d) const;
+  
+  /**
+   * Returns the value of a query word that is given to the kernels with
+   * the posting values: sqrt(q) for Bhattacharyya and q for the rest
+   * @param q word value in the query
+   * @return value for the kernels
+   */
+  inline WordValue queryValue(WordValue q) const;  
+  
+  /**
+   * Returns the code stored in a posting for a value. Quantized values are
+   * rounded to the nearest multiple of the scale of the row
+   * @param d posting value
+   * @param scale scale of the row
+   * @param nonzero if true, values other than 0 that round to 0 get the
+   *   code of the scale (see nonZeroCodes)
+   * @return code
+   */
+  static inline PostingCode quantize(WordValue d, WordValue scale, 
+    bool nonzero);
+  
+  /**
+   * Returns the code of a posting after multiplying the scale of its row
+   * by some ratio, rounded as quantize does
+   * @param c code with the old scale
+   * @param ratio new scale / old scale
+   * @param nonzero if true, codes other than 0 are not rounded to 0
+   * @return code with the new scale
+   */
+  static inline PostingCode requantize(PostingCode c, double ratio,
+    bool nonzero);
+  
+  /**
+   * Returns whether the codes of the weights other than 0 must not be 0.
+   * KL tells the words missing from an entry by their weight 0, so a small
+   * weight is stored as the scale of its row instead
+   * @return true iff quantized weights other than 0 keep a code other 
+   *   than 0
+   */
+  inline bool nonZeroCodes() const;
+  
+  /**
+   * Returns the value of a posting code. Inverse of quantize
+   * @param c code
+   * @param scale scale of the row
+   * @return posting value
+   */
+  static inline WordValue dequantize(PostingCode c, WordValue scale);
+  
+  /**
+   * Returns the scale a row needs to store a new value. Scales start with 
+   * room for values twice as large as the first one, and are doubled as
+   * many times as needed. Without quantization, it is always the same
+   * @param scale current scale of the row
+   * @param d new posting value
+   * @return new scale
+   */
+  static inline WordValue rowScale(WordValue scale, WordValue d);
+  
+  /**
+   * Returns how a row is read with the stop list
+   * @param word_id row of the inverted file
+   * @param nentries number of entries seen by the query
+   * @param limit maximum length of the rows read completely (> 0)
+   * @return 0 if the row is skipped, 1 if it is read completely, or the
+   *   distance between the postings read
+   */
+  inline unsigned int rowStep(WordId word_id, int nentries, 
+    size_t limit) const;
+  
+  /**
+   * Computes how the row of each word of a query is read with the stop 
+   * list
+   * @param vec query vector
+   * @param nentries number of entries seen by the query
+   * @param steps (out) step of each word of vec (see rowStep), or empty if
+   *   all the rows are read completely
+   */
+  void rowSteps(const BowVector &vec, int nentries, 
+    std::vector<unsigned int> &steps) const;
+  
+  /**
+   * Adds all the postings of a row to the scores of the given queries
+   * @param row reader of the row, at its beginning, with the range of 
+   *   entries to consider
+   * @param first first query that contains the word of the row
+   * @param last end of the queries
+   * @param step only one posting every step is added
+   */
+  void accumulate(RowReader &row, const WordQuery *first, 
+    const WordQuery *last, unsigned int step = 1) const;
+  
+  /**
+   * Adds the postings of a row with the given kernel
+   * @param K kernel class
+   * @param row reader of the row, at its beginning
+   * @param first first query that contains the word of the row
+   * @param last end of the queries
+   * @param step only one posting every step is added
+   */
+  template<class K>
+  static inline void scanRow(RowReader &row, const WordQuery *first, 
+    const WordQuery *last, unsigned int step = 1);
+  
+  /**
+   * Counts the postings of a row as common words of the given queries,
+   * before scoring them
+   * @param row reader of the row, at its beginning
+   * @param first first query that contains the word of the row
+   * @param last end of the queries
+   * @param step only one posting every step is counted
+   */
+  static inline void countRow(RowReader &row, const WordQuery *first, 
+    const WordQuery *last, unsigned int step = 1);
+
+  /**
+   * Removes the postings of the erased entries from a row
+   * @param word_id row to compact
+   * @param buf buffer for the new row
+   */
+  void compactRow(WordId word_id, std::vector<IFPair> &buf);
+  
+  /**
+   * Appends a posting to a row and updates the bounds of its weights
+   * @param word_id row
+   * @param entry_id entry id, greater than those in the row
+   * @param value posting value, as given by postingValue
+   */
+  void appendPosting(WordId word_id, EntryId entry_id, WordValue value);
+  
+  /**
+   * Quantizes the postings of a row with a greater scale and appends a new
+   * posting. Codes are divided by the ratio of the scales and rounded, so
+   * the error of a weight stays below the final scale of its row. Since
+   * rounding can increase a weight by half the new scale, the bounds of
+   * the blocks are widened by that much before the row is replaced
+   * @param word_id row
+   * @param scale new scale, a power of 2 times the current one, or the 
+   *   first scale of the row
+   * @param pair new posting, already quantized
+   */
+  void rescaleRow(WordId word_id, WordValue scale, const IFPair &pair);
+  
+  /**
+   * Compresses the complete blocks of the tail of a row
+   * @param word_id row
+   */
+  void compressRow(WordId word_id);
+  
+  /**
+   * Appends a compressed block to a buffer, and its entry to an index.
+   * The offset and the postings of the entry count from the start of buf
+   * @param first first posting of the block
+   * @param n number of postings (<= BLOCK_POSTINGS)
+   * @param scale scale of the postings
+   * @param buf (in/out) buffer
+   * @param index (in/out) index of the blocks of buf
+   */
+  static void encodeBlock(const IFPair *first, unsigned int n, 
+    WordValue scale, std::vector<unsigned char> &buf, 
+    std::vector<BlockEntry> &index);
+  
+  /**
+   * Computes the bounds of the weights of a row again
+   * @param word_id row
+   */
+  void updateBounds(WordId word_id);
+  
+  /**
+   * Scores the entries of a range of ids and selects the best ones, 
+   * skipping those that cannot be among the best results
+   * @param K kernel class, that can be pruned
+   * @param vec query vector
+   * @param acc accumulator for the scores, already reset
+   * @param ret (out) results, not sorted until finish is called
+   * @param max_results number of results to return (> 0)
+   * @param first_id first entry id of the range
+   * @param last_id end of the range
+   * @param steps step to read the row of each word of vec, or empty
+   * @param min_words minimum number of common words (< 0: default)
+   */
+  template<class K>
+  void queryPruned(const BowVector &vec, ScoreAccumulator &acc, 
+    QueryResults &ret, int max_results, int first_id, int last_id,
+    const std::vector<unsigned int> &steps, int min_words) const;
+  
+  /**
+   * Returns the k-th greatest gain of some entries not erased
+   * @param K kernel class, that can be pruned
+   * @param acc scores
+   * @param ids entries
+   * @param k rank of the gain
+   * @param gains buffer
+   * @return gain, or -infinity if there are fewer than k entries
+   */
+  template<class K>
+  double threshold(const ScoreAccumulator &acc, 
+    const std::vector<EntryId> &ids, unsigned int k, 
+    std::vector<double> &gains) const;
+  
+  /**
+   * Erases the oldest entries while the retention policy is exceeded
+   */
+  void evict();
+  
+  /**
+   * Returns the approximate memory of the postings of an entry
+   * @param nwords number of words of the entry
+   * @return bytes
+   */
+  inline size_t postingBytes(size_t nwords) const;
+  
+  /**
+   * Returns the approximate memory of the features of an entry in the 
+   * direct file
+   * @param fv feature vector
+   * @return bytes
+   */
+  static size_t featureBytes(const FeatureVector &fv);
+  
+  /**
+   * Computes the memory of all the entries again from the inverted and 
+   * direct files
+   */
+  void recomputeBytes();
+
+protected:
+
+  /// Associated vocabulary (may be shared with other databases)
+  std::shared_ptr<const TemplatedVocabulary<TDescriptor, F> > m_voc;
+  
+  /// Flag to use direct index
+  bool m_use_di;
+  
+  /// Levels to go up the vocabulary tree to select nodes to store
+  /// in the direct index
+  int m_dilevels;
+  
+  /// Inverted file (must have size() == |words|)
+  InvertedFile m_ifile;
+  
+  /// Direct file (resized for allocation)
+  DirectFile m_dfile;
+  
+  /// Number of valid entries in m_dfile. New entries are published by
+  /// updating this value when complete
+  std::atomic<int> m_nentries;
+  
+  /// Frees the rows of m_ifile replaced while being read by queries
+  MemoryReclaimer m_reclaimer;
+  
+  /// Maximum number of threads of a query
+  int m_query_threads;
+  
+  /// Threads that run the parts of queries and the batches of queryBatch
+  mutable ThreadPool m_workers;
+  
+  /// Flag to prune queries
+  bool m_pruning;
+  
+  /// Limits on the inverted rows read by queries
+  StopList m_stop;
+  
+  /// Minimum number of common words of the results of the queries that
+  /// do not set their own (< 0: default)
+  std::atomic<int> m_min_words;
+  
+  /// Maximum absolute weight of each row of m_ifile. Only grows with add
+  std::vector<AtomicValue<WordValue> > m_row_max;
+  
+  /// Bounds of the blocks of each row of m_ifile
+  std::vector<BlockRow> m_blocks;
+  
+  /// Flag to compress the blocks of the rows
+  bool m_compress;
+  
+  /// Compressed blocks of each row of m_ifile
+  std::vector<CompressedRow> m_compressed;
+  
+  /// Index of the blocks of each row of m_compressed
+  std::vector<BlockIndex> m_block_index;
+  
+  /// Erased entries (!= 0 if erased)
+  SegmentedArray<AtomicValue<unsigned char> > m_erased;
+  
+  /// Number of erased entries
+  std::atomic<unsigned int> m_nerased;
+  
+  /// Flag to use forward index
+  bool m_use_fi;
+  
+  /// Forward index (words of each entry), only if m_use_fi
+  std::vector<std::vector<WordId> > m_ffile;
+  
+  /* Compaction state */
+  
+  /// Rows with postings of erased entries, in the order they are 
+  /// compacted (with the forward index)
+  std::deque<WordId> m_dirty_rows;
+  
+  /// Whether each row is in m_dirty_rows
+  std::vector<bool> m_row_dirty;
+  
+  /// Number of rows added to and taken from m_dirty_rows so far
+  unsigned long long m_rows_queued, m_rows_compacted;
+  
+  /// Whether all the rows are being compacted (without the forward index)
+  bool m_sweeping;
+  
+  /// Number of erased entries that wait for a sweep to start
+  unsigned int m_unswept;
+  
+  /// Next row to compact when sweeping
+  WordId m_sweep_next;
+  
+  /// Number of complete sweeps so far
+  unsigned long long m_sweeps;
+  
+  /// Erased entries whose features are not freed yet, with the value 
+  /// m_rows_compacted (or m_sweeps) must reach before freeing them
+  std::deque<std::pair<EntryId, unsigned long long> > m_uncompacted;
+  
+  /* Retention */
+  
+  /// Limits on the entries kept
+  RetentionPolicy m_retention;
+  
+  /// Timestamp and memory of each entry
+  SegmentedArray<EntryInfo> m_info;
+  
+  /// Approximate memory used by the entries not erased
+  std::atomic<size_t> m_bytes;
+  
+  /// No entry below this id is left to erase by the retention policy
+  EntryId m_oldest;
+  
+};
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
+  (bool use_di, int di_levels)
+  : m_use_di(use_di), m_dilevels(di_levels),
+    m_nentries(0), m_query_threads(1), m_pruning(false), m_min_words(-1),
+    m_compress(false), m_nerased(0), m_use_fi(false), m_rows_queued(0),
+    m_rows_compacted(0), m_sweeping(false), m_unswept(0),
+    m_sweep_next(0), m_sweeps(0), m_bytes(0), m_oldest(0)
+{
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
+  (const T &voc, bool use_di, int di_levels)
+  : m_use_di(use_di), m_dilevels(di_levels),
+    m_nentries(0), m_query_threads(1), m_pruning(false), m_min_words(-1),
+    m_compress(false), m_nerased(0), m_use_fi(false), m_rows_queued(0),
+    m_rows_compacted(0), m_sweeping(false), m_unswept(0),
+    m_sweep_next(0), m_sweeps(0), m_bytes(0), m_oldest(0)
+{
+  setVocabulary(voc);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
+  (const std::shared_ptr<T> &voc, bool use_di, int di_levels)
+  : m_use_di(use_di), m_dilevels(di_levels),
+    m_nentries(0), m_query_threads(1), m_pruning(false), m_min_words(-1),
+    m_compress(false), m_nerased(0), m_use_fi(false), m_rows_queued(0),
+    m_rows_compacted(0), m_sweeping(false), m_unswept(0),
+    m_sweep_next(0), m_sweeps(0), m_bytes(0), m_oldest(0)
+{
+  setVocabulary(voc);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor,F>::TemplatedDatabase
+  (const TemplatedDatabase<TDescriptor,F> &db)
+  : m_nentries(0), m_query_threads(1), m_pruning(false),
+    m_min_words(-1), m_compress(false), m_nerased(0), m_use_fi(false),
+    m_rows_queued(0), m_rows_compacted(0), m_sweeping(false),
+    m_unswept(0), m_sweep_next(0), m_sweeps(0), m_bytes(0),
+    m_oldest(0)
+{
+  *this = db;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
+  (const std::string &filename)
+  : m_nentries(0), m_query_threads(1), m_pruning(false),
+    m_min_words(-1), m_compress(false), m_nerased(0), m_use_fi(false),
+    m_rows_queued(0), m_rows_compacted(0), m_sweeping(false),
+    m_unswept(0), m_sweep_next(0), m_sweeps(0), m_bytes(0),
+    m_oldest(0)
+{
+  load(filename);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
+  (const char *filename)
+  : m_nentries(0), m_query_threads(1), m_pruning(false),
+    m_min_words(-1), m_compress(false), m_nerased(0), m_use_fi(false),
+    m_rows_queued(0), m_rows_compacted(0), m_sweeping(false),
+    m_unswept(0), m_sweep_next(0), m_sweeps(0), m_bytes(0),
+    m_oldest(0)
+{
+  load(filename);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor, F>::~TemplatedDatabase(void)
+{
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor,F>& TemplatedDatabase<TDescriptor,F>::operator=
+  (const TemplatedDatabase<TDescriptor,F> &db)
+{
+  if(this != &db)
+  {
+    m_voc = db.m_voc;
+    m_dfile = db.m_dfile;
+    m_dilevels = db.m_dilevels;
+    m_ifile = db.m_ifile;
+    m_nentries.store(db.m_nentries.load());
+    m_use_di = db.m_use_di;
+    m_query_threads = db.m_query_threads;
+    m_pruning = db.m_pruning;
+    m_stop = db.m_stop;
+    m_min_words.store(db.m_min_words.load());
+    m_row_max = db.m_row_max;
+    m_blocks = db.m_blocks;
+    m_compress = db.m_compress;
+    m_compressed = db.m_compressed;
+    m_block_index = db.m_block_index;
+    m_erased = db.m_erased;
+    m_nerased.store(db.m_nerased.load());
+    m_use_fi = db.m_use_fi;
+    m_ffile = db.m_ffile;
+    m_dirty_rows = db.m_dirty_rows;
+    m_row_dirty = db.m_row_dirty;
+    m_rows_queued = db.m_rows_queued;
+    m_rows_compacted = db.m_rows_compacted;
+    m_sweeping = db.m_sweeping;
+    m_unswept = db.m_unswept;
+    m_sweep_next = db.m_sweep_next;
+    m_sweeps = db.m_sweeps;
+    m_uncompacted = db.m_uncompacted;
+    m_retention = db.m_retention;
+    m_info = db.m_info;
+    m_bytes.store(db.m_bytes.load());
+    m_oldest = db.m_oldest;
+  }
+  return *this;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+EntryId TemplatedDatabase<TDescriptor, F>::add(
+  const std::vector<TDescriptor> &features,
+  BowVector *bowvec, FeatureVector *fvec, double timestamp)
+{
+  BowVector aux;
+  BowVector& v = (bowvec ? *bowvec : aux);
+  
+  if(m_use_di && fvec != NULL)
+  {
+    m_voc->transform(features, v, *fvec, m_dilevels); // with features
+    return add(v, *fvec, timestamp);
+  }
+  else if(m_use_di)
+  {
+    FeatureVector fv;
+    m_voc->transform(features, v, fv, m_dilevels); // with features
+    return add(v, fv, timestamp);
+  }
+  else if(fvec != NULL)
+  {
+    m_voc->transform(features, v, *fvec, m_dilevels); // with features
+    return add(v, FeatureVector(), timestamp);
+  }
+  else
+  {
+    m_voc->transform(features, v); // with features
+    return add(v, FeatureVector(), timestamp);
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+EntryId TemplatedDatabase<TDescriptor, F>::add(const BowVector &v,
+  const FeatureVector &fv, double timestamp)
+{
+  EntryId entry_id = m_nentries.load(std::memory_order_relaxed);
+
+  BowVector::const_iterator vit;
+
+  if(m_use_di)
+  {
+    // update direct file
+    if(entry_id >= m_dfile.size())
+    {
+      m_dfile.resize(entry_id + 1);
+    }
+    m_dfile[entry_id].assign(fv, m_reclaimer);
+  }
+  
+  if(m_use_fi)
+  {
+    // update forward index
+    m_ffile.resize(entry_id + 1);
+    m_ffile[entry_id].resize(0);
+    m_ffile[entry_id].reserve(v.size());
+    for(vit = v.begin(); vit != v.end(); ++vit)
+      m_ffile[entry_id].push_back(vit->first);
+  }
+  
+  // new entries are not erased
+  if(entry_id >= m_erased.size()) m_erased.resize(entry_id + 1);
+  
+  if(entry_id >= m_info.size()) m_info.resize(entry_id + 1);
+  m_info[entry_id].timestamp = timestamp;
+  m_info[entry_id].bytes = postingBytes(v.size()) + 
+    (m_use_di ? featureBytes(m_dfile[entry_id].get()) : 0);
+  m_bytes.store(m_bytes.load() + m_info[entry_id].bytes);
+  
+  // update inverted file
+  for(vit = v.begin(); vit != v.end(); ++vit)
+  {
+    appendPosting(vit->first, entry_id, postingValue(vit->second));
+  }
+  
+  // publish the entry
+  m_nentries.store(entry_id + 1, std::memory_order_release);
+  
+  if(m_retention.active())
+  {
+    // erase the oldest entries and spread the compaction of their rows
+    // over the next additions
+    evict();
+    compact(m_retention.compact_rows > 0 ? 
+      (int)m_retention.compact_rows : std::max((int)v.size(), 1));
+  }
+  
+  return entry_id;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+inline void TemplatedDatabase<TDescriptor, F>::setVocabulary
+  (const T& voc)
+{
+  m_voc.reset(new T(voc));
+  clear();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+inline void TemplatedDatabase<TDescriptor, F>::setVocabulary
+  (const T& voc, bool use_di, int di_levels)
+{
+  m_use_di = use_di;
+  m_dilevels = di_levels;
+  m_voc.reset(new T(voc));
+  clear();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+inline void TemplatedDatabase<TDescriptor, F>::setVocabulary
+  (const std::shared_ptr<T> &voc)
+{
+  m_voc = voc;
+  clear();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+void TemplatedDatabase<TDescriptor, F>::setVocabulary
+  (const std::shared_ptr<T> &voc, bool use_di, int di_levels)
+{
+  m_use_di = use_di;
+  m_dilevels = di_levels;
+  m_voc = voc;
+  clear();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline const TemplatedVocabulary<TDescriptor,F>* 
+TemplatedDatabase<TDescriptor, F>::getVocabulary() const
+{
+  return m_voc.get();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline std::shared_ptr<const TemplatedVocabulary<TDescriptor,F> >
+TemplatedDatabase<TDescriptor, F>::getSharedVocabulary() const
+{
+  return m_voc;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedDatabase<TDescriptor, F>::clear()
+{
+  // resize vectors
+  m_ifile.resize(0);
+  m_ifile.resize(m_voc->size());
+  m_row_max.assign(m_voc->size(), AtomicValue<WordValue>(0));
+  m_blocks.resize(0);
+  m_blocks.resize(m_voc->size());
+  m_compressed.resize(0);
+  m_compressed.resize(m_voc->size());
+  m_block_index.resize(0);
+  m_block_index.resize(m_voc->size());
+  m_dfile.clear();
+  m_nentries.store(0);
+  
+  m_erased.clear();
+  m_nerased.store(0);
+  m_ffile.clear();
+  m_dirty_rows.clear();
+  m_row_dirty.assign(m_voc->size(), false);
+  m_rows_queued = m_rows_compacted = 0;
+  m_sweeping = false;
+  m_unswept = 0;
+  m_sweep_next = 0;
+  m_sweeps = 0;
+  m_uncompacted.clear();
+  
+  m_info.clear();
+  m_bytes.store(0);
+  m_oldest = 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedDatabase<TDescriptor, F>::erase(EntryId id)
+{
+  if(id >= size() || isErased(id)) return false;
+  
+  // queries ignore the entry from now on
+  m_erased[id].store(1);
+  m_nerased.store(m_nerased.load() + 1);
+  m_bytes.store(m_bytes.load() - m_info[id].bytes);
+  
+  if(m_use_fi)
+  {
+    // only the rows of its words must be compacted. Rows already queued
+    // are compacted before those added now
+    std::vector<WordId>::const_iterator wit;
+    for(wit = m_ffile[id].begin(); wit != m_ffile[id].end(); ++wit)
+    {
+      if(!m_row_dirty[*wit])
+      {
+        m_row_dirty[*wit] = true;
+        m_dirty_rows.push_back(*wit);
+        ++m_rows_queued;
+      }
+    }
+    std::vector<WordId>().swap(m_ffile[id]);
+    
+    m_uncompacted.push_back(std::make_pair(id, m_rows_queued));
+  }
+  else
+  {
+    // all the rows must be compacted by a sweep that starts after now,
+    // which waits for more erased entries (see compact)
+    ++m_unswept;
+    m_uncompacted.push_back(std::make_pair(id, 
+      m_sweeps + (m_sweeping ? 2 : 1)));
+  }
+  
+  return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::isErased(EntryId id) const
+{
+  return m_erased[id].load() != 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+unsigned int TemplatedDatabase<TDescriptor, F>::compact(int max_rows)
+{
+  std::vector<IFPair> buf;
+  int nrows = 0;
+  
+  while((max_rows <= 0 || nrows < max_rows) && !m_dirty_rows.empty())
+  {
+    const WordId word_id = m_dirty_rows.front();
+    m_dirty_rows.pop_front();
+    m_row_dirty[word_id] = false;
+    
+    compactRow(word_id, buf);
+    ++m_rows_compacted;
+    ++nrows;
+  }
+  
+  // a sweep rewrites all the rows, so it is shared by as many erased 
+  // entries as possible: it starts when a fraction of the entries wait
+  // for it, or for any of them if all the rows are to be compacted
+  const unsigned int batch = std::max(1u, 
+    (size() - std::min(m_nerased.load(), size())) / SWEEP_FRACTION);
+  
+  while(max_rows <= 0 || nrows < max_rows)
+  {
+    if(!m_sweeping)
+    {
+      if(m_unswept == 0 || (max_rows > 0 && m_unswept < batch)) break;
+      
+      m_sweeping = true;
+      m_unswept = 0;
+    }
+    
+    compactRow(m_sweep_next, buf);
+    ++nrows;
+    
+    if(++m_sweep_next >= m_ifile.size())
+    {
+      ++m_sweeps;
+      m_sweep_next = 0;
+      m_sweeping = false;
+    }
+  }
+  
+  // free the features of the entries without postings left
+  const unsigned long long done = (m_use_fi ? m_rows_compacted : m_sweeps);
+  while(!m_uncompacted.empty() && m_uncompacted.front().second <= done)
+  {
+    const EntryId id = m_uncompacted.front().first;
+    if(id < m_dfile.size()) m_dfile[id].reset(m_reclaimer);
+    m_uncompacted.pop_front();
+  }
+  
+  m_reclaimer.collect();
+  
+  unsigned int pending = (unsigned int)m_dirty_rows.size();
+  if(m_sweeping) pending += (unsigned int)m_ifile.size() - m_sweep_next;
+  if(m_unswept >= batch) pending += (unsigned int)m_ifile.size();
+  return pending;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::compactRow(WordId word_id, 
+  std::vector<IFPair> &buf)
+{
+  bool changed = false;
+  
+  if(!m_compressed[word_id].snapshot().empty())
+  {
+    // each block is encoded again without the postings of the erased 
+    // entries, keeping its scale, so the codes do not change
+    std::vector<unsigned char> blocks;
+    std::vector<BlockEntry> index;
+    RowReader reader(*this, word_id, 0, std::numeric_limits<EntryId>::max());
+    typename IFRow::Snapshot seg(NULL, NULL);
+    
+    while(reader.next(seg) && !reader.inTail())
+    {
+      buf.resize(0);
+      for(unsigned int i = 0; i < seg.size(); ++i)
+        if(!isErased(seg[i].entry_id)) buf.push_back(seg[i]);
+      
+      if(!buf.empty()) 
+        encodeBlock(&buf[0], buf.size(), seg.header(), blocks, index);
+      changed = changed || (buf.size() < seg.size());
+    }
+    
+    // the blocks are replaced before the tail (see compressRow), and
+    // before their index. Both keep a buffer for the new version even if
+    // they are empty
+    if(changed)
+    {
+      const unsigned int version = m_compressed[word_id].header() + 1;
+      
+      m_compressed[word_id].assign(blocks.empty() ? NULL : &blocks[0], 
+        blocks.empty() ? NULL : &blocks[0] + blocks.size(), version,
+        m_reclaimer, 1);
+      m_block_index[word_id].assign(index.empty() ? NULL : &index[0],
+        index.empty() ? NULL : &index[0] + index.size(), version,
+        m_reclaimer, 1);
+    }
+  }
+  
+  const typename IFRow::Snapshot row = m_ifile[word_id].snapshot();
+  typename IFRow::const_iterator rit;
+  
+  buf.resize(0);
+  for(rit = row.begin(); rit != row.end(); ++rit)
+  {
+    if(!isErased(rit->entry_id)) buf.push_back(*rit);
+  }
+  
+  // the row is replaced only if it changes, readers keep the old one
+  if(buf.size() < row.size())
+  {
+    if(buf.empty())
+      m_ifile[word_id].clear(m_reclaimer);
+    else
+      m_ifile[word_id].assign(&buf[0], &buf[0] + buf.size(), m_reclaimer);
+    
+    changed = true;
+  }
+  
+  // the old bounds are still valid, but these are tighter
+  if(changed) updateBounds(word_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::appendPosting(WordId word_id, 
+  EntryId entry_id, WordValue value)
+{
+  IFRow &ifrow = m_ifile[word_id];
+  
+  const WordValue old_scale = ifrow.header();
+  const WordValue scale = rowScale(old_scale, value);
+  const IFPair pair(entry_id, quantize(value, scale, nonZeroCodes()));
+  
+  // the maximum is updated before the posting is visible, so queries 
+  // never see a posting greater than it
+  AtomicValue<WordValue> &row_max = m_row_max[word_id];
+  const WordValue w = fabs(dequantize(pair.word_weight, scale));
+  if(w > row_max.load()) row_max.store(w);
+  
+  if(scale != old_scale)
+    rescaleRow(word_id, scale, pair);
+  else
+    ifrow.push_back(pair, m_reclaimer);
+  
+  if(ifrow.size() % BLOCK_POSTINGS == 0)
+  {
+    // a block is complete
+    const typename IFRow::Snapshot row = ifrow.snapshot();
+    typename IFRow::const_iterator rit;
+    
+    WordValue block_max = 0;
+    for(rit = row.end() - BLOCK_POSTINGS; rit != row.end(); ++rit)
+      block_max = std::max(block_max, 
+        (WordValue)fabs(dequantize(rit->word_weight, row.header())));
+    
+    m_blocks[word_id].push_back(BlockBound(entry_id, block_max), 
+      m_reclaimer);
+    
+    if(m_compress) compressRow(word_id);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::rescaleRow(WordId word_id, 
+  WordValue scale, const IFPair &pair)
+{
+  const typename IFRow::Snapshot row = m_ifile[word_id].snapshot();
+  typename IFRow::const_iterator rit;
+  
+  // the codes of a row without scale are 0
+  const double ratio = (row.header() > 0 ? scale / row.header() : 1);
+  const bool nonzero = nonZeroCodes();
+  
+  std::vector<IFPair> buf;
+  buf.reserve(row.size() + 1);
+  for(rit = row.begin(); rit != row.end(); ++rit)
+  {
+    buf.push_back(IFPair(rit->entry_id, 
+      requantize(rit->word_weight, ratio, nonzero)));
+  }
+  buf.push_back(pair);
+  
+  // the bounds must hold for the old and the new row. The maximum of the
+  // row is the new posting, which no rescaled code can exceed
+  const typename BlockRow::Snapshot blocks = m_blocks[word_id].snapshot();
+  if(row.header() > 0 && !blocks.empty())
+  {
+    std::vector<BlockBound> wider(blocks.begin(), blocks.end());
+    for(size_t i = 0; i < wider.size(); ++i)
+      wider[i].max_weight += scale / 2;
+    
+    m_blocks[word_id].assign(&wider[0], &wider[0] + wider.size(), 
+      m_reclaimer);
+  }
+  
+  // readers keep the old row, with its own scale
+  m_ifile[word_id].assign(&buf[0], &buf[0] + buf.size(), scale, 
+    m_reclaimer);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::compressRow(WordId word_id)
+{
+  IFRow &ifrow = m_ifile[word_id];
+  const typename IFRow::Snapshot row = ifrow.snapshot();
+  
+  const unsigned int n = row.size() - row.size() % BLOCK_POSTINGS;
+  if(n == 0) return;
+  
+  std::vector<unsigned char> blocks;
+  std::vector<BlockEntry> index;
+  for(unsigned int i = 0; i < n; i += BLOCK_POSTINGS)
+  {
+    encodeBlock(row.begin() + i, BLOCK_POSTINGS, row.header(), blocks, 
+      index);
+  }
+  
+  // the new blocks follow those already compressed
+  const typename BlockIndex::Snapshot old = m_block_index[word_id].snapshot();
+  const unsigned int offset = m_compressed[word_id].size();
+  const unsigned int postings = (old.empty() ? 0 : old[old.size()-1].postings);
+  for(size_t i = 0; i < index.size(); ++i)
+  {
+    index[i].offset += offset;
+    index[i].postings += postings;
+  }
+  
+  // the blocks are published before their index, and both before they
+  // are removed from the tail. Readers take the tail first, so they may 
+  // see some postings twice, which RowReader skips, but never miss them
+  m_compressed[word_id].append(&blocks[0], &blocks[0] + blocks.size(), 
+    m_reclaimer);
+  m_block_index[word_id].append(&index[0], &index[0] + index.size(), 
+    m_reclaimer);
+  ifrow.assign(row.begin() + n, row.end(), row.header(), m_reclaimer, 
+    BLOCK_POSTINGS);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::encodeBlock(const IFPair *first, 
+  unsigned int n, WordValue scale, std::vector<unsigned char> &buf,
+  std::vector<BlockEntry> &index)
+{
+  CompressedBlock h;
+  h.first_id = first[0].entry_id;
+  h.last_id = first[n-1].entry_id;
+  h.count = (unsigned short)n;
+  h.scale = scale;
+  
+  EntryId ids[BLOCK_POSTINGS];
+  for(unsigned int i = 0; i < n; ++i) ids[i] = first[i].entry_id;
+  
+  const size_t pos = buf.size();
+  buf.resize(pos + sizeof(h) + DeltaCodec::maxBytes(n - 1) + 
+    n * sizeof(PostingCode));
+  
+  h.id_bytes = (unsigned short)
+    DeltaCodec::encode(ids + 1, n - 1, ids[0], &buf[pos + sizeof(h)]);
+  
+  unsigned char *codes = &buf[pos + sizeof(h) + h.id_bytes];
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    const PostingCode c = first[i].word_weight;
+    memcpy(codes + i * sizeof(PostingCode), &c, sizeof(PostingCode));
+  }
+  
+  h.bytes = (unsigned int)(sizeof(h) + h.id_bytes + n * sizeof(PostingCode));
+  memcpy(&buf[pos], &h, sizeof(h));
+  buf.resize(pos + h.bytes);
+  
+  BlockEntry e;
+  e.first_id = h.first_id;
+  e.last_id = h.last_id;
+  e.offset = (unsigned int)pos;
+  e.postings = (index.empty() ? 0 : index.back().postings) + n;
+  index.push_back(e);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor, F>::RowReader::RowReader(
+  const TemplatedDatabase &db, WordId word_id, EntryId first_id, 
+  EntryId last_id)
+  : m_tail(db.m_ifile[word_id].snapshot()), 
+    m_index(db.m_block_index[word_id].snapshot()),
+    m_data(db.m_compressed[word_id].snapshot()),
+    m_first_id(first_id), m_last_id(last_id), m_size(0), m_position(0),
+    m_last_size(0), m_in_tail(false), m_tail_read(false), m_counted(false),
+    m_skipped(false)
+{
+  // the tail is taken before the index, and this before the blocks (see
+  // compressRow), unless the blocks were encoded again in between (see 
+  // compactRow). The writer publishes both soon after
+  while(m_index.header() != m_data.header())
+  {
+    m_index = db.m_block_index[word_id].snapshot();
+    m_data = db.m_compressed[word_id].snapshot();
+  }
+  
+  m_begin = std::lower_bound(m_index.begin(), m_index.end(), first_id, 
+    endsBefore);
+  m_end = std::lower_bound(m_begin, m_index.end(), last_id, startsBefore);
+  m_next = m_begin;
+  m_ids_block = m_index.end();
+  
+  // postings already compressed are skipped in the tail
+  EntryId tail_id = first_id;
+  if(!m_index.empty())
+    tail_id = std::max(tail_id, m_index[m_index.size()-1].last_id + 1);
+  
+  m_tail = clipRow(m_tail, tail_id, last_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+size_t TemplatedDatabase<TDescriptor, F>::RowReader::size()
+{
+  if(m_counted) return m_size;
+  
+  m_size = m_tail.size();
+  
+  if(m_begin != m_end)
+  {
+    const typename BlockIndex::const_iterator last = m_end - 1;
+    m_size += last->postings - 
+      (m_begin == m_index.begin() ? 0 : (m_begin - 1)->postings);
+    
+    // the blocks at the ends may have postings out of the range. The ids
+    // of the first one are decoded last, so that next reuses them
+    CompressedBlock h;
+    if(last->last_id >= m_last_id)
+    {
+      decodeIds(last, h);
+      m_size -= (m_ids + h.count) - 
+        std::lower_bound(m_ids, m_ids + h.count, m_last_id);
+    }
+    if(m_begin->first_id < m_first_id)
+    {
+      decodeIds(m_begin, h);
+      m_size -= std::lower_bound(m_ids, m_ids + h.count, m_first_id) - 
+        m_ids;
+    }
+  }
+  
+  m_counted = true;
+  return m_size;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedDatabase<TDescriptor, F>::RowReader::next(
+  typename IFRow::Snapshot &seg, EntryId min_id)
+{
+  Segment s;
+  if(!next(s, min_id))
+  {
+    seg = typename IFRow::Snapshot(NULL, NULL);
+    return false;
+  }
+  
+  if(s.pairs != NULL)
+  {
+    seg = m_tail;
+  }
+  else
+  {
+    for(unsigned int i = 0; i < s.size; ++i) 
+      m_buf[i] = IFPair(s.ids[i], s.code(i));
+    seg = typename IFRow::Snapshot(m_buf, m_buf + s.size, s.scale);
+  }
+  
+  return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedDatabase<TDescriptor, F>::RowReader::next(Segment &seg, 
+  EntryId min_id)
+{
+  m_position += m_last_size;
+  m_last_size = 0;
+  
+  if(m_next != m_end && m_next->last_id < min_id)
+  {
+    m_next = std::lower_bound(m_next, m_end, min_id, endsBefore);
+    m_skipped = true;
+  }
+  
+  CompressedBlock h;
+  while(m_next != m_end)
+  {
+    const typename BlockIndex::const_iterator block = m_next++;
+    decodeIds(block, h);
+    
+    const EntryId *first = m_ids, *last = m_ids + h.count;
+    if(block->first_id < m_first_id)
+      first = std::lower_bound(first, last, m_first_id);
+    if(block->last_id >= m_last_id)
+      last = std::lower_bound(first, last, m_last_id);
+    
+    if(first == last) continue;
+    
+    seg.pairs = NULL;
+    seg.ids = first;
+    seg.codes = m_data.begin() + block->offset + sizeof(h) + h.id_bytes +
+      (first - m_ids) * sizeof(PostingCode);
+    seg.size = (unsigned int)(last - first);
+    seg.scale = h.scale;
+    
+    m_last_size = seg.size;
+    m_in_tail = false;
+    return true;
+  }
+  
+  if(!m_tail_read && !m_tail.empty())
+  {
+    m_tail_read = true;
+    seg.pairs = m_tail.begin();
+    seg.ids = NULL;
+    seg.codes = NULL;
+    seg.size = (unsigned int)m_tail.size();
+    seg.scale = m_tail.header();
+    
+    m_last_size = seg.size;
+    m_in_tail = true;
+    return true;
+  }
+  
+  // a row read completely has been counted
+  if(!m_skipped)
+  {
+    m_size = m_position;
+    m_counted = true;
+  }
+  
+  seg.pairs = NULL;
+  seg.size = 0;
+  return false;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::RowReader::decodeIds(
+  typename BlockIndex::const_iterator block, CompressedBlock &h)
+{
+  const unsigned char *b = m_data.begin() + block->offset;
+  memcpy(&h, b, sizeof(h));
+  
+  if(block == m_ids_block) return;
+  
+  m_ids[0] = h.first_id;
+  // the rest of the row can be read past the ids, which is faster
+  DeltaCodec::decode(b + sizeof(h), m_data.end() - (b + sizeof(h)), 
+    h.count - 1, h.first_id, m_ids + 1);
+  m_ids_block = block;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::updateBounds(WordId word_id)
+{
+  RowReader reader(*this, word_id, 0, std::numeric_limits<EntryId>::max());
+  typename IFRow::Snapshot seg(NULL, NULL);
+  
+  std::vector<BlockBound> blocks;
+  blocks.reserve(reader.size() / BLOCK_POSTINGS + 1);
+  
+  // each compressed block is a block of the bounds, and so is each
+  // BLOCK_POSTINGS postings of the tail
+  WordValue row_max = 0;
+  while(reader.next(seg))
+  {
+    WordValue block_max = 0;
+    for(size_t i = 0; i < seg.size(); ++i)
+    {
+      const WordValue w = fabs(dequantize(seg[i].word_weight, seg.header()));
+      row_max = std::max(row_max, w);
+      block_max = std::max(block_max, w);
+      
+      if(reader.inTail() && (i + 1) % BLOCK_POSTINGS == 0)
+      {
+        blocks.push_back(BlockBound(seg[i].entry_id, block_max));
+        block_max = 0;
+      }
+    }
+    
+    if(!reader.inTail())
+      blocks.push_back(BlockBound(seg[seg.size()-1].entry_id, block_max));
+  }
+  
+  if(blocks.empty())
+    m_blocks[word_id].clear(m_reclaimer);
+  else
+    m_blocks[word_id].assign(&blocks[0], &blocks[0] + blocks.size(), 
+      m_reclaimer);
+  
+  m_row_max[word_id].store(row_max);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setForwardIndex(bool use)
+{
+  // pending compaction depends on the forward index
+  compact();
+  
+  m_use_fi = use;
+  m_ffile.clear();
+  
+  if(m_use_fi)
+  {
+    // words of the existing entries, in ascending order
+    m_ffile.resize(size());
+    
+    for(WordId word_id = 0; word_id < m_ifile.size(); ++word_id)
+    {
+      RowReader row(*this, word_id, 0, std::numeric_limits<EntryId>::max());
+      typename IFRow::Snapshot seg(NULL, NULL);
+      typename IFRow::const_iterator rit;
+      
+      while(row.next(seg))
+      {
+        for(rit = seg.begin(); rit != seg.end(); ++rit)
+        {
+          if(!isErased(rit->entry_id))
+            m_ffile[rit->entry_id].push_back(word_id);
+        }
+      }
+    }
+  }
+  
+  // the memory of the postings depends on the forward index
+  recomputeBytes();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::usingForwardIndex() const
+{
+  return m_use_fi;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setCompression(bool compress)
+{
+  m_compress = compress;
+  
+  if(m_compress)
+  {
+    for(WordId word_id = 0; word_id < m_ifile.size(); ++word_id)
+      compressRow(word_id);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::usingCompression() const
+{
+  return m_compress;
+}
+
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
-  (bool use_di, int di_levels)
-  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels), m_nentries(0)
+void TemplatedDatabase<TDescriptor, F>::setRetention
+  (const RetentionPolicy &policy)
 {
+  m_retention = policy;
+  m_oldest = 0;
+  
+  if(m_retention.active()) evict();
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-template<class T>
-TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
-  (const T &voc, bool use_di, int di_levels)
-  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels)
+inline const RetentionPolicy& 
+  TemplatedDatabase<TDescriptor, F>::getRetention() const
 {
-  setVocabulary(voc);
-  clear();
+  return m_retention;
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-TemplatedDatabase<TDescriptor,F>::TemplatedDatabase
-  (const TemplatedDatabase<TDescriptor,F> &db)
-  : m_voc(NULL)
+inline double TemplatedDatabase<TDescriptor, F>::getTimestamp
+  (EntryId id) const
 {
-  *this = db;
+  return m_info[id].timestamp;
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
-  (const std::string &filename)
-  : m_voc(NULL)
+inline size_t TemplatedDatabase<TDescriptor, F>::getMemoryUsage() const
 {
-  load(filename);
+  return m_bytes.load();
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
-  (const char *filename)
-  : m_voc(NULL)
+void TemplatedDatabase<TDescriptor, F>::evict()
 {
-  load(filename);
+  const int nentries = m_nentries.load(std::memory_order_relaxed);
+  if(nentries == 0) return;
+  
+  const EntryId newest = nentries - 1;
+  const double min_timestamp = m_info[newest].timestamp - 
+    m_retention.max_age;
+  
+  // entries are erased in id order, so the ids below m_oldest need not be
+  // visited again
+  for(; m_oldest < newest; ++m_oldest)
+  {
+    if(isErased(m_oldest)) continue;
+    
+    const unsigned int live = nentries - m_nerased.load();
+    
+    if((m_retention.max_entries > 0 && live > m_retention.max_entries) ||
+      (m_retention.max_bytes > 0 && m_bytes.load() > m_retention.max_bytes) ||
+      (m_retention.max_age > 0 && m_info[m_oldest].timestamp < min_timestamp))
+    {
+      erase(m_oldest);
+    }
+    else break;
+  }
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-TemplatedDatabase<TDescriptor, F>::~TemplatedDatabase(void)
+inline size_t TemplatedDatabase<TDescriptor, F>::postingBytes
+  (size_t nwords) const
 {
-  delete m_voc;
+  return nwords * (sizeof(IFPair) + (m_use_fi ? sizeof(WordId) : 0));
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-TemplatedDatabase<TDescriptor,F>& TemplatedDatabase<TDescriptor,F>::operator=
-  (const TemplatedDatabase<TDescriptor,F> &db)
+size_t TemplatedDatabase<TDescriptor, F>::featureBytes
+  (const FeatureVector &fv)
 {
-  if(this != &db)
+  return fv.memoryUsage();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::recomputeBytes()
+{
+  const EntryId nentries = size();
+  if(m_info.size() < nentries) m_info.resize(nentries);
+  
+  std::vector<size_t> nwords(nentries, 0);
+  for(WordId word_id = 0; word_id < m_ifile.size(); ++word_id)
   {
-    m_dfile = db.m_dfile;
-    m_dilevels = db.m_dilevels;
-    m_ifile = db.m_ifile;
-    m_nentries = db.m_nentries;
-    m_use_di = db.m_use_di;
-    setVocabulary(*db.m_voc);
+    RowReader row(*this, word_id, 0, nentries);
+    typename IFRow::Snapshot seg(NULL, NULL);
+    typename IFRow::const_iterator rit;
+    while(row.next(seg))
+    {
+      for(rit = seg.begin(); rit != seg.end(); ++rit) ++nwords[rit->entry_id];
+    }
   }
-  return *this;
+  
+  size_t total = 0;
+  for(EntryId id = 0; id < nentries; ++id)
+  {
+    if(isErased(id))
+    {
+      m_info[id].bytes = 0;
+    }
+    else
+    {
+      m_info[id].bytes = postingBytes(nwords[id]) + 
+        (m_use_di && id < m_dfile.size() ?
+          featureBytes(m_dfile[id].get()) : 0);
+      total += m_info[id].bytes;
+    }
+  }
+  m_bytes.store(total);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::allocate(int nd, int ni)
+{
+  // m_ifile already contains |words| items
+  if(ni > 0)
+  {
+    typename std::vector<IFRow>::iterator rit;
+    for(rit = m_ifile.begin(); rit != m_ifile.end(); ++rit)
+    {
+      rit->reserve(ni, m_reclaimer);
+    }
+  }
+  
+  if(m_use_di && (int)m_dfile.size() < nd)
+  {
+    m_dfile.resize(nd);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline unsigned int TemplatedDatabase<TDescriptor, F>::size() const
+{
+  return m_nentries;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::usingDirectIndex() const
+{
+  return m_use_di;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline int TemplatedDatabase<TDescriptor, F>::getDirectIndexLevels() const
+{
+  return m_dilevels;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setQueryThreads(int nthreads)
+{
+  if(nthreads <= 0) nthreads = (int)std::thread::hardware_concurrency();
+  m_query_threads = (nthreads > 0 ? nthreads : 1);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline int TemplatedDatabase<TDescriptor, F>::getQueryThreads() const
+{
+  return m_query_threads;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setQueryPruning(bool prune)
+{
+  m_pruning = prune;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::usingQueryPruning() const
+{
+  return m_pruning;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setStopList(const StopList &stop)
+{
+  m_stop = stop;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline const StopList& TemplatedDatabase<TDescriptor, F>::getStopList() const
+{
+  return m_stop;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setMinCommonWords(int n)
+{
+  m_min_words.store(n);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline int TemplatedDatabase<TDescriptor, F>::getMinCommonWords() const
+{
+  return minCommonWords(m_min_words.load());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline int TemplatedDatabase<TDescriptor, F>::minCommonWords(int n) const
+{
+  if(n >= 0) return n;
+  
+  // these scorings were always filtered
+  const ScoringType s = (m_voc ? m_voc->getScoringType() : L1_NORM);
+  return (s == CHI_SQUARE || s == BHATTACHARYYA ? MIN_COMMON_WORDS : 0);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+QueryContext& TemplatedDatabase<TDescriptor, F>::threadContext()
+{
+  static thread_local QueryContext ctx;
+  return ctx;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+typename TemplatedDatabase<TDescriptor, F>::BatchContext& 
+  TemplatedDatabase<TDescriptor, F>::threadBatchContext()
+{
+  static thread_local BatchContext ctx;
+  return ctx;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const std::vector<TDescriptor> &features,
+  QueryResults &ret, int max_results, int max_id) const
+{
+  query(features, ret, threadContext(), max_results, max_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const BowVector &vec, 
+  QueryResults &ret, int max_results, int max_id) const
+{
+  query(vec, ret, threadContext(), max_results, max_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const std::vector<TDescriptor> &features,
+  QueryResults &ret, QueryContext &ctx, int max_results, int max_id) const
+{
+  m_voc->transform(features, ctx.vec);
+  query(ctx.vec, ret, ctx, max_results, max_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const BowVector &vec, QueryResults &ret, QueryContext &ctx,
+  int max_results, int max_id) const
+{
+  query(vec, ret, ctx, EntryRange(0, max_id), max_results);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const std::vector<TDescriptor> &features, QueryResults &ret,
+  const EntryRange &range, int max_results) const
+{
+  query(features, ret, threadContext(), range, max_results);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const BowVector &vec, QueryResults &ret, 
+  const EntryRange &range, int max_results) const
+{
+  query(vec, ret, threadContext(), range, max_results);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const std::vector<TDescriptor> &features, QueryResults &ret,
+  QueryContext &ctx, const EntryRange &range, int max_results) const
+{
+  m_voc->transform(features, ctx.vec);
+  query(ctx.vec, ret, ctx, range, max_results);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const BowVector &vec, QueryResults &ret, QueryContext &ctx,
+  const EntryRange &range, int max_results) const
+{
+  ret.resize(0);
+  
+  // rows replaced by a concurrent add are not freed while this query runs,
+  // and the entries added after this point are ignored
+  MemoryReclaimer::ReadGuard guard(m_reclaimer);
+  
+  const int nentries = m_nentries.load(std::memory_order_acquire);
+  
+  int first_id, last_id;
+  range.resolve(nentries, first_id, last_id);
+  
+  // rows read with the stop list
+  rowSteps(vec, nentries, ctx.steps);
+  
+  ctx.stop_words = 0;
+  ctx.skipped_postings = 0;
+  
+  BowVector::const_iterator vit;
+  size_t k = 0;
+  for(vit = vec.begin(); k < ctx.steps.size(); ++vit, ++k)
+  {
+    const unsigned int step = ctx.steps[k];
+    if(step == 1) continue;
+    
+    const size_t n = RowReader(*this, vit->first, first_id, last_id).size();
+    
+    ++ctx.stop_words;
+    ctx.skipped_postings += (step == 0 ? n : n - (n + step - 1) / step);
+  }
+  
+  // the minimum of the query, read once
+  const int min_words = (ctx.min_common_words >= 0 ? 
+    ctx.min_common_words : m_min_words.load());
+  
+  const int nthreads = queryThreads(vec, last_id - first_id);
+  
+  if(nthreads <= 1)
+  {
+    queryRange(vec, ctx.scores, ret, max_results, first_id, last_id, 
+      ctx.steps, min_words);
+  }
+  else
+  {
+    // each thread of the pool scores a range of entries and selects the 
+    // best ones, the first part writing directly in ret
+    ctx.thread_scores.resize(nthreads);
+    ctx.thread_results.resize(nthreads);
+    
+    PartJob job;
+    job.db = this;
+    job.vec = &vec;
+    job.ctx = &ctx;
+    job.ret = &ret;
+    job.max_results = max_results;
+    job.first_id = first_id;
+    job.last_id = last_id;
+    job.min_words = min_words;
+    job.nparts = nthreads;
+    
+    m_workers.run(nthreads, std::cref(job));
+    
+    // merge the best results of all the threads. Since ties are broken
+    // by entry id, the results are those of a single thread
+    const ResultOrder better = resultOrder();
+    QueryResults::const_iterator rit;
+    for(int t = 1; t < nthreads; ++t)
+    {
+      const QueryResults &tret = ctx.thread_results[t];
+      for(rit = tret.begin(); rit != tret.end(); ++rit)
+        ret.pushBest(*rit, max_results, better);
+    }
+  }
+  
+  finish(ret, max_results);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryPart(const BowVector &vec,
+  QueryContext &ctx, QueryResults &ret, int max_results, int first_id, 
+  int last_id, int min_words, int nparts, unsigned int t) const
+{
+  const long long n = last_id - first_id;
+  const int first = first_id + (int)(n * t / nparts);
+  const int last = first_id + (int)(n * (t + 1) / nparts);
+  
+  if(t == 0)
+    queryRange(vec, ctx.scores, ret, max_results, first, last, ctx.steps,
+      min_words);
+  else
+    queryRange(vec, ctx.thread_scores[t], ctx.thread_results[t], 
+      max_results, first, last, ctx.steps, min_words);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-EntryId TemplatedDatabase<TDescriptor, F>::add(
-  const std::vector<TDescriptor> &features,
-  BowVector *bowvec, FeatureVector *fvec)
+void TemplatedDatabase<TDescriptor, F>::queryRange(const BowVector &vec,
+  ScoreAccumulator &acc, QueryResults &ret, int max_results, 
+  int first_id, int last_id, const std::vector<unsigned int> &steps,
+  int min_words) const
 {
-  BowVector aux;
-  BowVector& v = (bowvec ? *bowvec : aux);
+  ret.resize(0);
   
-  if(m_use_di && fvec != NULL)
-  {
-    m_voc->transform(features, v, *fvec, m_dilevels); // with features
-    return add(v, *fvec);
-  }
-  else if(m_use_di)
+  // the default minimum of chi-square and Bhattacharyya is only checked
+  // when selecting the results
+  const int count_words = std::max(min_words, 0);
+  
+  // < sum vi, sum wi > are accumulated for chi square only
+  acc.reset(last_id, m_voc->getScoringType() == CHI_SQUARE, count_words);
+  
+  WordQuery wq;
+  wq.acc = &acc;
+  
+  if(first_id >= last_id) return;
+  
+  BowVector::const_iterator vit;
+  size_t k;
+  
+  if(count_words > 1)
   {
-    FeatureVector fv;
-    m_voc->transform(features, v, fv, m_dilevels); // with features
-    return add(v, fv);
+    // the entries without enough common words are not scored then
+    for(vit = vec.begin(), k = 0; vit != vec.end(); ++vit, ++k)
+    {
+      const unsigned int step = (steps.empty() ? 1 : steps[k]);
+      if(step == 0) continue;
+      
+      RowReader row(*this, vit->first, first_id, last_id);
+      countRow(row, &wq, &wq + 1, step);
+    }
   }
-  else if(fvec != NULL)
+  
+  if(m_pruning && max_results > 0)
   {
-    m_voc->transform(features, v, *fvec, m_dilevels); // with features
-    return add(v);
+    switch(m_voc->getScoringType())
+    {
+      case L1_NORM:
+        queryPruned<L1Kernel>(vec, acc, ret, max_results, first_id, last_id,
+          steps, min_words);
+        return;
+      
+      case L2_NORM:
+        queryPruned<L2Kernel>(vec, acc, ret, max_results, first_id, last_id,
+          steps, min_words);
+        return;
+      
+      case DOT_PRODUCT:
+        if(m_voc->getWeightingType() == BINARY)
+          queryPruned<BinaryDotProductKernel>(vec, acc, ret, max_results,
+            first_id, last_id, steps, min_words);
+        else
+          queryPruned<DotProductKernel>(vec, acc, ret, max_results,
+            first_id, last_id, steps, min_words);
+        return;
+      
+      default:
+        break;
+    }
   }
-  else
+  
+  for(vit = vec.begin(), k = 0; vit != vec.end(); ++vit, ++k)
   {
-    m_voc->transform(features, v); // with features
-    return add(v);
+    const unsigned int step = (steps.empty() ? 1 : steps[k]);
+    if(step == 0) continue;
+    
+    wq.value = queryValue(vit->second);
+    RowReader row(*this, vit->first, first_id, last_id);
+    accumulate(row, &wq, &wq + 1, step);
   }
+  
+  select(vec, acc, ret, max_results, steps, min_words);
 }
 
-// ---------------------------------------------------------------------------
+// --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-EntryId TemplatedDatabase<TDescriptor, F>::add(const BowVector &v,
-  const FeatureVector &fv)
+template<class K>
+void TemplatedDatabase<TDescriptor, F>::queryPruned(const BowVector &vec,
+  ScoreAccumulator &acc, QueryResults &ret, int max_results, 
+  int first_id, int last_id, const std::vector<unsigned int> &steps,
+  int min_words) const
 {
-  EntryId entry_id = m_nentries++;
-
+  // scratch memory of the calling thread
+  static thread_local std::vector<PrunedWord> words;
+  static thread_local std::vector<double> remaining;
+  static thread_local std::vector<EntryId> candidates;
+  static thread_local std::vector<double> gains;
+  
+  // the bounds of the postings of the entries < last_id were updated 
+  // before the entries were published. The stop words skipped are left
+  // out, and the bounds still hold for those that are subsampled
+  words.resize(0);
   BowVector::const_iterator vit;
-  std::vector<unsigned int>::const_iterator iit;
-
-  if(m_use_di)
+  size_t k = 0;
+  for(vit = vec.begin(); vit != vec.end(); ++vit, ++k)
   {
-    // update direct file
-    if(entry_id == m_dfile.size())
-    {
-      m_dfile.push_back(fv);
-    }
-    else
+    const unsigned int step = (steps.empty() ? 1 : steps[k]);
+    if(step == 0) continue;
+    
+    words.push_back(PrunedWord(vit->first, vit->second, 
+      K::bound(vit->second, m_row_max[vit->first].load()), step));
+  }
+  
+  // words with greater contribution first
+  std::sort(words.begin(), words.end());
+  
+  // remaining[i]: maximum gain of an entry with words i..n-1 only
+  remaining.resize(words.size() + 1);
+  remaining[words.size()] = 0;
+  for(size_t i = words.size(); i > 0; --i)
+    remaining[i-1] = remaining[i] + words[i-1].bound;
+  
+  // gain an entry must reach to be among the best results so far
+  double theta = -std::numeric_limits<double>::infinity();
+  
+  // the rows of the first words are scored completely, while an entry 
+  // not found yet can still reach the best results
+  size_t i = 0;
+  size_t scanned = 0;
+  for(; i < words.size() && !(remaining[i] < theta); ++i)
+  {
+    RowReader row(*this, words[i].word_id, first_id, last_id);
+    
+    WordQuery wq(words[i].value, &acc);
+    scanRow<K>(row, &wq, &wq + 1, words[i].step);
+    
+    // the threshold is updated when there have been scanned twice as many 
+    // postings as entries touched, to bound its cost, and only once the
+    // gains may be greater than the remaining ones
+    scanned += row.size() / words[i].step;
+    if(scanned >= 2 * acc.touched().size() && 
+      remaining[0] - remaining[i+1] > remaining[i+1])
     {
-      m_dfile[entry_id] = fv;
+      theta = threshold<K>(acc, acc.touched(), max_results, gains);
+      scanned = 0;
     }
   }
   
-  // update inverted file
-  for(vit = v.begin(); vit != v.end(); ++vit)
+  if(i < words.size())
   {
-    const WordId& word_id = vit->first;
-    const WordValue& word_weight = vit->second;
+    // the rest of the rows are only looked up for the candidates that can
+    // still reach the best results
+    const bool any_erased = (m_nerased.load() > 0);
+    
+    // candidates are sorted by id. If most entries were touched, it is
+    // cheaper to go through all of them than to sort them
+    candidates.resize(0);
+    const std::vector<EntryId> &touched = acc.touched();
+    const bool dense = 
+      (touched.size() * CANDIDATE_LOOKUP_COST > (size_t)(last_id - first_id));
     
-    IFRow& ifrow = m_ifile[word_id];
-    ifrow.push_back(IFPair(entry_id, word_weight));
+    for(size_t t = 0; t < (dense ? last_id - first_id : touched.size()); ++t)
+    {
+      const EntryId id = (dense ? first_id + t : touched[t]);
+      
+      if(dense && acc.words(id) == 0) continue;
+      if(any_erased && isErased(id)) continue;
+      if(K::gain(acc.score(id)) + remaining[i] < theta) continue;
+      candidates.push_back(id);
+    }
+    if(!dense) std::sort(candidates.begin(), candidates.end());
+    
+    scanned = 0;
+    for(; i < words.size() && !candidates.empty(); ++i)
+    {
+      const PrunedWord &word = words[i];
+      RowReader row(*this, word.word_id, first_id, last_id);
+      
+      if(word.step > 1 || 
+        candidates.size() * CANDIDATE_LOOKUP_COST > row.size())
+      {
+        // scanning the row is cheaper than looking up the candidates. The
+        // entries that are not candidates are scored too, but they cannot
+        // reach the best results anyway. Subsampled rows are always 
+        // scanned, so that the same postings are read as without pruning
+        WordQuery wq(word.value, &acc);
+        scanRow<K>(row, &wq, &wq + 1, word.step);
+        
+        // the candidates are filtered as seldom as the threshold above
+        scanned += row.size() / word.step;
+        if(scanned < 2 * candidates.size()) continue;
+        scanned = 0;
+        
+        theta = std::max(theta, 
+          threshold<K>(acc, candidates, max_results, gains));
+        
+        size_t n = 0;
+        for(size_t c = 0; c < candidates.size(); ++c)
+        {
+          const EntryId id = candidates[c];
+          if(K::gain(acc.score(id)) + remaining[i+1] >= theta)
+            candidates[n++] = id;
+        }
+        candidates.resize(n);
+        
+        continue;
+      }
+      
+      const typename BlockRow::Snapshot blocks = 
+        m_blocks[word.word_id].snapshot();
+      
+      typename IFRow::Snapshot seg(NULL, NULL);
+      typename IFRow::const_iterator rit = seg.begin();
+      typename BlockRow::const_iterator bit = blocks.begin();
+      bool more = true;
+      
+      size_t n = 0;
+      for(size_t c = 0; c < candidates.size(); ++c)
+      {
+        const EntryId id = candidates[c];
+        const double gain = K::gain(acc.score(id));
+        
+        // bound of the block where the entry would be
+        while(bit != blocks.end() && bit->last_id < id) ++bit;
+        const double bound = (bit != blocks.end() ? 
+          K::bound(word.value, bit->max_weight) : word.bound);
+        
+        // the entry cannot reach the best results
+        if(gain + bound + remaining[i+1] < theta) continue;
+        
+        // segment where the entry would be. The compressed blocks before
+        // it are skipped without decoding them
+        while(more && (rit == seg.end() || (seg.end() - 1)->entry_id < id))
+        {
+          more = row.next(seg, id);
+          rit = seg.begin();
+        }
+        
+        // galloping search, since candidates are sorted too
+        size_t step = 1;
+        while(step < (size_t)(seg.end() - rit) && rit[step].entry_id < id)
+        {
+          rit += step;
+          step *= 2;
+        }
+        rit = std::lower_bound(rit, 
+          rit + std::min(step + 1, (size_t)(seg.end() - rit)), id);
+        
+        if(rit != seg.end() && rit->entry_id == id)
+          K::add(acc, id, word.value, 
+            dequantize(rit->word_weight, seg.header()));
+        
+        candidates[n++] = id;
+      }
+      candidates.resize(n);
+      
+      theta = std::max(theta, 
+        threshold<K>(acc, candidates, max_results, gains));
+    }
   }
   
-  return entry_id;
+  // the entries dropped have lower gains than the best results, so they
+  // are never selected
+  select(vec, acc, ret, max_results, steps, min_words);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-template<class T>
-inline void TemplatedDatabase<TDescriptor, F>::setVocabulary
-  (const T& voc)
+template<class K>
+double TemplatedDatabase<TDescriptor, F>::threshold(
+  const ScoreAccumulator &acc, const std::vector<EntryId> &ids, 
+  unsigned int k, std::vector<double> &gains) const
 {
-  delete m_voc;
-  m_voc = new T(voc);
-  clear();
+  const bool any_erased = (m_nerased.load() > 0);
+  
+  // the k greatest gains are kept in a heap whose front is the lowest one
+  gains.resize(0);
+  std::vector<EntryId>::const_iterator eit;
+  for(eit = ids.begin(); eit != ids.end(); ++eit)
+  {
+    const double gain = K::gain(acc.score(*eit));
+    
+    if(gains.size() == k && !(gain > gains.front())) continue;
+    if(any_erased && isErased(*eit)) continue;
+    
+    if(gains.size() < k)
+    {
+      gains.push_back(gain);
+      std::push_heap(gains.begin(), gains.end(), std::greater<double>());
+    }
+    else
+    {
+      std::pop_heap(gains.begin(), gains.end(), std::greater<double>());
+      gains.back() = gain;
+      std::push_heap(gains.begin(), gains.end(), std::greater<double>());
+    }
+  }
+  
+  return (gains.size() < k ? -std::numeric_limits<double>::infinity() : 
+    gains.front());
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-template<class T>
-inline void TemplatedDatabase<TDescriptor, F>::setVocabulary
-  (const T& voc, bool use_di, int di_levels)
+int TemplatedDatabase<TDescriptor, F>::queryThreads(const BowVector &vec,
+  int nids) const
 {
-  m_use_di = use_di;
-  m_dilevels = di_levels;
-  delete m_voc;
-  m_voc = new T(voc);
-  clear();
+  if(m_query_threads <= 1) return 1;
+  
+  size_t postings = 0;
+  BowVector::const_iterator vit;
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
+    postings += RowReader(*this, vit->first, 0, 
+      std::numeric_limits<EntryId>::max()).size();
+  
+  size_t nthreads = postings / PARALLEL_QUERY_POSTINGS;
+  if(nthreads > (size_t)m_query_threads) nthreads = m_query_threads;
+  if(nthreads > (size_t)nids) nthreads = nids;
+  
+  return (nthreads > 1 ? (int)nthreads : 1);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-inline const TemplatedVocabulary<TDescriptor,F>* 
-TemplatedDatabase<TDescriptor, F>::getVocabulary() const
+void TemplatedDatabase<TDescriptor, F>::queryBatch(
+  const std::vector<BowVector> &vecs, std::vector<QueryResults> &rets,
+  int max_results, int max_id, int nthreads, int min_common_words) const
 {
-  return m_voc;
+  queryBatch(vecs, rets, EntryRange(0, max_id), max_results, nthreads,
+    min_common_words);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-inline void TemplatedDatabase<TDescriptor, F>::clear()
+void TemplatedDatabase<TDescriptor, F>::queryBatch(
+  const std::vector<BowVector> &vecs, std::vector<QueryResults> &rets,
+  const EntryRange &range, int max_results, int nthreads,
+  int min_common_words) const
 {
-  // resize vectors
-  m_ifile.resize(0);
-  m_ifile.resize(m_voc->size());
-  m_dfile.resize(0);
-  m_nentries = 0;
+  rets.resize(vecs.size());
+  if(vecs.empty()) return;
+  
+  // all the queries see the same entries
+  MemoryReclaimer::ReadGuard guard(m_reclaimer);
+  
+  const int nentries = m_nentries.load(std::memory_order_acquire);
+  
+  int first_id, last_id;
+  range.resolve(nentries, first_id, last_id);
+  
+  const int min_words = (min_common_words >= 0 ? min_common_words : 
+    m_min_words.load());
+  
+  const int nbatches = (int)((vecs.size() + BATCH_QUERIES - 1) / BATCH_QUERIES);
+  
+  if(nthreads <= 0) nthreads = (int)std::thread::hardware_concurrency();
+  if(nthreads <= 0) nthreads = 1;
+  if(nthreads > nbatches) nthreads = nbatches;
+  
+  // batches are taken in order by the threads of the pool
+  BatchJob job;
+  job.db = this;
+  job.vecs = &vecs;
+  job.rets = &rets;
+  job.max_results = max_results;
+  job.first_id = first_id;
+  job.last_id = last_id;
+  job.nentries = nentries;
+  job.min_words = min_words;
+  job.next_batch = 0;
+  
+  m_workers.run(nthreads, std::ref(job));
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::allocate(int nd, int ni)
+void TemplatedDatabase<TDescriptor, F>::queryBatches(
+  const std::vector<BowVector> &vecs, std::vector<QueryResults> &rets,
+  int max_results, int first_id, int last_id, int nentries, int min_words,
+  std::atomic<int> &next_batch) const
 {
-  // m_ifile already contains |words| items
-  if(ni > 0)
+  const bool with_sums = (m_voc->getScoringType() == CHI_SQUARE);
+  const int count_words = std::max(min_words, 0);
+  
+  // maximum length of the rows read completely
+  const size_t limit = (m_stop.active() ? 
+    m_stop.limit(nentries - std::min(m_nerased.load(), 
+      (unsigned int)nentries)) : 0);
+  
+  BatchContext &batch = threadBatchContext();
+  std::vector<QueryContext> &ctxs = batch.queries;
+  std::vector<BatchWord> &words = batch.words;
+  std::vector<WordQuery> &group = batch.group;
+  if(ctxs.size() < (size_t)BATCH_QUERIES) ctxs.resize(BATCH_QUERIES);
+  
+  BowVector::const_iterator vit;
+  
+  for(;;)
   {
-    typename std::vector<IFRow>::iterator rit;
-    for(rit = m_ifile.begin(); rit != m_ifile.end(); ++rit)
+    const size_t first = (size_t)next_batch.fetch_add(1) * BATCH_QUERIES;
+    if(first >= vecs.size()) break;
+    const size_t last = std::min(first + BATCH_QUERIES, vecs.size());
+    
+    // group the words of the queries of this batch
+    words.resize(0);
+    for(size_t q = first; q < last; ++q)
+    {
+      ctxs[q - first].scores.reset(last_id, with_sums, count_words);
+      
+      for(vit = vecs[q].begin(); vit != vecs[q].end(); ++vit)
+        words.push_back(BatchWord(vit->first, (unsigned int)(q - first),
+          queryValue(vit->second)));
+    }
+    
+    std::sort(words.begin(), words.end());
+    
+    // scan each row once for all the queries that contain its word. If 
+    // the results need some common words, they are counted in a first pass
+    for(int pass = (count_words > 1 ? 0 : 1); pass < 2; ++pass)
     {
-      int n = (int)rit->size();
-      if(ni > n)
+      typename std::vector<BatchWord>::const_iterator wit = words.begin();
+      while(wit != words.end())
       {
-        rit->resize(ni);
-        rit->resize(n);
+        const WordId word_id = wit->word_id;
+        
+        group.resize(0);
+        for(; wit != words.end() && wit->word_id == word_id; ++wit)
+          group.push_back(WordQuery(wit->value, &ctxs[wit->query].scores));
+        
+        const unsigned int step = (limit > 0 ? 
+          rowStep(word_id, nentries, limit) : 1);
+        
+        if(step == 0) continue;
+        
+        RowReader row(*this, word_id, first_id, last_id);
+        if(pass == 0)
+          countRow(row, &group[0], &group[0] + group.size(), step);
+        else
+          accumulate(row, &group[0], &group[0] + group.size(), step);
       }
     }
+    
+    for(size_t q = first; q < last; ++q)
+    {
+      QueryContext &ctx = ctxs[q - first];
+      
+      // only KL needs to know the stop words when selecting
+      if(limit > 0 && m_voc->getScoringType() == KL)
+        rowSteps(vecs[q], nentries, ctx.steps);
+      else
+        ctx.steps.resize(0);
+      
+      rets[q].resize(0);
+      select(vecs[q], ctx.scores, rets[q], max_results, ctx.steps,
+        min_words);
+      finish(rets[q], max_results);
+    }
   }
-  
-  if(m_use_di && (int)m_dfile.size() < nd)
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::accumulate(RowReader &row, 
+  const WordQuery *first, const WordQuery *last, unsigned int step) const
+{
+  switch(m_voc->getScoringType())
   {
-    m_dfile.resize(nd);
+    case L1_NORM:
+      scanRow<L1Kernel>(row, first, last, step);
+      break;
+      
+    case L2_NORM:
+      scanRow<L2Kernel>(row, first, last, step);
+      break;
+      
+    case CHI_SQUARE:
+      scanRow<ChiSquareKernel>(row, first, last, step);
+      break;
+      
+    case KL:
+      scanRow<KLKernel>(row, first, last, step);
+      break;
+      
+    case BHATTACHARYYA:
+      scanRow<DotProductKernel>(row, first, last, step);
+      break;
+      
+    case DOT_PRODUCT:
+      if(m_voc->getWeightingType() == BINARY)
+        scanRow<BinaryDotProductKernel>(row, first, last, step);
+      else
+        scanRow<DotProductKernel>(row, first, last, step);
+      break;
   }
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-inline unsigned int TemplatedDatabase<TDescriptor, F>::size() const
+inline typename TemplatedDatabase<TDescriptor, F>::IFRow::Snapshot
+TemplatedDatabase<TDescriptor, F>::clipRow(
+  const typename IFRow::Snapshot &row, EntryId first_id, EntryId last_id)
 {
-  return m_nentries;
+  // IFRows are sorted in ascending entry_id order
+  typename IFRow::const_iterator first = row.begin(), last = row.end();
+  
+  if(first != last && first->entry_id < first_id)
+    first = std::lower_bound(first, last, first_id);
+  
+  if(first != last && (last - 1)->entry_id >= last_id)
+    last = std::lower_bound(first, last, last_id);
+  
+  return typename IFRow::Snapshot(first, last, row.header());
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-inline bool TemplatedDatabase<TDescriptor, F>::usingDirectIndex() const
+inline WordValue TemplatedDatabase<TDescriptor, F>::postingValue(
+  WordValue w) const
 {
-  return m_use_di;
+  switch(m_voc->getScoringType())
+  {
+    case BHATTACHARYYA:
+      return sqrt(w);
+      
+#ifndef DBOW2_QUANTIZED_POSTINGS
+    case KL:
+      // words may have weight zero
+      return (w != 0 ? log(w) : -std::numeric_limits<WordValue>::infinity());
+#endif
+      
+    default:
+      return w;
+  }
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-inline int TemplatedDatabase<TDescriptor, F>::getDirectIndexLevels() const
+inline WordValue TemplatedDatabase<TDescriptor, F>::postingWeight(
+  WordValue d) const
 {
-  return m_dilevels;
+  switch(m_voc->getScoringType())
+  {
+    case BHATTACHARYYA:
+      return d * d;
+      
+#ifndef DBOW2_QUANTIZED_POSTINGS
+    case KL:
+      return exp(d);
+#endif
+      
+    default:
+      return d;
+  }
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::query(
-  const std::vector<TDescriptor> &features,
-  QueryResults &ret, int max_results, int max_id) const
+inline WordValue TemplatedDatabase<TDescriptor, F>::queryValue(
+  WordValue q) const
 {
-  BowVector vec;
-  m_voc->transform(features, vec);
-  query(vec, ret, max_results, max_id);
+  return (m_voc->getScoringType() == BHATTACHARYYA ? sqrt(q) : q);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::query(
-  const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+inline typename TemplatedDatabase<TDescriptor, F>::PostingCode 
+TemplatedDatabase<TDescriptor, F>::quantize(WordValue d, WordValue scale,
+  bool nonzero)
 {
-  ret.resize(0);
+#ifdef DBOW2_QUANTIZED_POSTINGS
+  if(scale == 0) return 0;
   
-  switch(m_voc->getScoringType())
-  {
-    case L1_NORM:
-      queryL1(vec, ret, max_results, max_id);
-      break;
-      
-    case L2_NORM:
-      queryL2(vec, ret, max_results, max_id);
-      break;
-      
-    case CHI_SQUARE:
-      queryChiSquare(vec, ret, max_results, max_id);
-      break;
-      
-    case KL:
-      queryKL(vec, ret, max_results, max_id);
-      break;
-      
-    case BHATTACHARYYA:
-      queryBhattacharyya(vec, ret, max_results, max_id);
-      break;
-      
-    case DOT_PRODUCT:
-      queryDotProduct(vec, ret, max_results, max_id);
-      break;
-  }
+  const double c = std::floor(d / scale + 0.5);
+  if(c > MAX_POSTING_CODE) return MAX_POSTING_CODE;
+  else if(c < -MAX_POSTING_CODE) return -MAX_POSTING_CODE;
+  else if(c == 0 && nonzero && d != 0) return (d > 0 ? 1 : -1);
+  else return (PostingCode)c;
+#else
+  return d;
+#endif
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline typename TemplatedDatabase<TDescriptor, F>::PostingCode 
+TemplatedDatabase<TDescriptor, F>::requantize(PostingCode c, double ratio,
+  bool nonzero)
+{
+#ifdef DBOW2_QUANTIZED_POSTINGS
+  const PostingCode r = (PostingCode)std::floor(c / ratio + 0.5);
+  if(r == 0 && nonzero && c != 0) return (c > 0 ? 1 : -1);
+  else return r;
+#else
+  return c;
+#endif
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::nonZeroCodes() const
+{
+  return m_voc->getScoringType() == KL;
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryL1(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+inline WordValue TemplatedDatabase<TDescriptor, F>::dequantize(
+  PostingCode c, WordValue scale)
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-    
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+#ifdef DBOW2_QUANTIZED_POSTINGS
+  return c * scale;
+#else
+  return c;
+#endif
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline WordValue TemplatedDatabase<TDescriptor, F>::rowScale(
+  WordValue scale, WordValue d)
+{
+#ifdef DBOW2_QUANTIZED_POSTINGS
+  d = fabs(d);
+  if(scale == 0) return 2 * d / MAX_POSTING_CODE;
+  while(d > scale * MAX_POSTING_CODE) scale *= 2;
+#endif
+  return scale;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline unsigned int TemplatedDatabase<TDescriptor, F>::rowStep(
+  WordId word_id, int nentries, size_t limit) const
+{
+  // the postings of the entries the query does not see are not counted
+  const size_t n = RowReader(*this, word_id, 0, nentries).size();
   
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
-  {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-        
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value = fabs(qvalue - dvalue) - fabs(qvalue) - fabs(dvalue);
-        
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
-	
-  // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
-  {
-    ret.push_back(Result(pit->first, pit->second));
-  }
-	
-  // resulting "scores" are now in [-2 best .. 0 worst]	
-  
-  // sort vector in ascending order of score
-  std::sort(ret.begin(), ret.end());
-  // (ret is inverted now --the lower the better--)
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-  
-  // complete and scale score to [0 worst .. 1 best]
-  // ||v - w||_{L1} = 2 + Sum(|v_i - w_i| - |v_i| - |w_i|) 
-  //		for all i | v_i != 0 and w_i != 0 
-  // (Nister, 2006)
-  // scaled_||v - w||_{L1} = 1 - 0.5 * ||v - w||_{L1}
-  QueryResults::iterator qit;
-  for(qit = ret.begin(); qit != ret.end(); qit++) 
-    qit->Score = -qit->Score/2.0;
+  if(n <= limit) return 1;
+  else if(!m_stop.subsample) return 0;
+  else return (unsigned int)((n + limit - 1) / limit);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryL2(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+void TemplatedDatabase<TDescriptor, F>::rowSteps(const BowVector &vec,
+  int nentries, std::vector<unsigned int> &steps) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
+  steps.resize(0);
+  if(!m_stop.active()) return;
   
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+  // the limit is relative to the entries not erased
+  const size_t limit = m_stop.limit(nentries - 
+    std::min(m_nerased.load(), (unsigned int)nentries));
   
-  //map<EntryId, int> counters;
-  //map<EntryId, int>::iterator cit;
+  bool any = false;
   
+  steps.reserve(vec.size());
+  BowVector::const_iterator vit;
   for(vit = vec.begin(); vit != vec.end(); ++vit)
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value = - qvalue * dvalue; // minus sign for sorting trick
-        
-        pit = pairs.lower_bound(entry_id);
-        //cit = counters.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value; 
-          //cit->second += 1;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-          
-          //counters.insert(cit, 
-          //  map<EntryId, int>::value_type(entry_id, 1));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
-	
-  // move to vector
-  ret.reserve(pairs.size());
-  //cit = counters.begin();
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)//, ++cit)
-  {
-    ret.push_back(Result(pit->first, pit->second));// / cit->second));
-  }
-	
-  // resulting "scores" are now in [-1 best .. 0 worst]	
-  
-  // sort vector in ascending order of score
-  std::sort(ret.begin(), ret.end());
-  // (ret is inverted now --the lower the better--)
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
-  // complete and scale score to [0 worst .. 1 best]
-  // ||v - w||_{L2} = sqrt( 2 - 2 * Sum(v_i * w_i) 
-	//		for all i | v_i != 0 and w_i != 0 )
-	// (Nister, 2006)
-	QueryResults::iterator qit;
-  for(qit = ret.begin(); qit != ret.end(); qit++) 
-  {
-    if(qit->Score <= -1.0) // rounding error
-      qit->Score = 1.0;
-    else
-      qit->Score = 1.0 - sqrt(1.0 + qit->Score); // [0..1]
-      // the + sign is ok, it is due to - sign in 
-      // value = - qvalue * dvalue
+    steps.push_back(rowStep(vit->first, nentries, limit));
+    any = any || (steps.back() != 1);
   }
   
+  // all the rows are read completely
+  if(!any) steps.resize(0);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryChiSquare(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+template<class K>
+inline void TemplatedDatabase<TDescriptor, F>::scanRow(RowReader &row, 
+  const WordQuery *first, const WordQuery *last, unsigned int step)
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-  
-  std::map<EntryId, std::pair<double, int> > pairs;
-  std::map<EntryId, std::pair<double, int> >::iterator pit;
+  const WordQuery *qit;
+  typename RowReader::Segment seg;
   
-  std::map<EntryId, std::pair<double, double> > sums; // < sum vi, sum wi >
-  std::map<EntryId, std::pair<double, double> >::iterator sit;
-  
-  // In the current implementation, we suppose vec is not normalized
-  
-  //map<EntryId, double> expected;
-  //map<EntryId, double>::iterator eit;
-  
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  while(row.next(seg))
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
+    const WordValue scale = seg.scale;
     
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
+    if(seg.pairs != NULL)
     {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
+      for(unsigned int i = row.start(step); i < seg.size; i += step)
       {
-        // (v-w)^2/(v+w) - v - w = -4 vw/(v+w)
-        // we move the 4 out
-        double value = 0;
-        if(qvalue + dvalue != 0.0) // words may have weight zero
-          value = - qvalue * dvalue / (qvalue + dvalue);
+        const EntryId entry_id = seg.pairs[i].entry_id;
+        const WordValue dvalue = dequantize(seg.pairs[i].word_weight, scale);
         
-        pit = pairs.lower_bound(entry_id);
-        sit = sums.lower_bound(entry_id);
-        //eit = expected.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
+        for(qit = first; qit != last; ++qit)
+          K::add(*qit->acc, entry_id, qit->value, dvalue);
+      }
+    }
+    else if(step == 1)
+    {
+      // the ids and the codes of a block are arrays, so its postings are
+      // scored in two passes, computing their values first, which is 
+      // faster than adding them one by one
+      double values[BLOCK_POSTINGS];
+      WordValue weights[BLOCK_POSTINGS];
+      
+      for(qit = first; qit != last; ++qit)
+      {
+        if(!qit->acc->hasSums())
         {
-          pit->second.first += value;
-          pit->second.second += 1;
-          //eit->second += dvalue;
-          sit->second.first += qvalue;
-          sit->second.second += dvalue;
+          for(unsigned int i = 0; i < seg.size; ++i)
+            values[i] = K::value(qit->value, dequantize(seg.code(i), scale));
+          
+          qit->acc->add(seg.ids, values, seg.size);
         }
         else
         {
-          pairs.insert(pit, 
-            std::map<EntryId, std::pair<double, int> >::value_type(entry_id,
-              std::make_pair(value, 1) ));
-          //expected.insert(eit, 
-          //  map<EntryId, double>::value_type(entry_id, dvalue));
+          // chi square accumulates the weights too
+          for(unsigned int i = 0; i < seg.size; ++i)
+          {
+            weights[i] = dequantize(seg.code(i), scale);
+            values[i] = K::value(qit->value, weights[i]);
+          }
           
-          sums.insert(sit, 
-            std::map<EntryId, std::pair<double, double> >::value_type(entry_id,
-              std::make_pair(qvalue, dvalue) ));
+          qit->acc->add(seg.ids, values, seg.size, qit->value, weights);
         }
       }
-      
-    } // for each inverted row
-  } // for each query word
-	
-  // move to vector
-  ret.reserve(pairs.size());
-  sit = sums.begin();
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit, ++sit)
-  {
-    if(pit->second.second >= MIN_COMMON_WORDS)
+    }
+    else
     {
-      ret.push_back(Result(pit->first, pit->second.first));
-      ret.back().nWords = pit->second.second;
-      ret.back().sumCommonVi = sit->second.first;
-      ret.back().sumCommonWi = sit->second.second;
-      ret.back().expectedChiScore = 
-        2 * sit->second.second / (1 + sit->second.second);
+      for(unsigned int i = row.start(step); i < seg.size; i += step)
+      {
+        const EntryId entry_id = seg.ids[i];
+        const WordValue dvalue = dequantize(seg.code(i), scale);
+        
+        for(qit = first; qit != last; ++qit)
+          K::add(*qit->acc, entry_id, qit->value, dvalue);
+      }
     }
-  
-    //ret.push_back(Result(pit->first, pit->second));
   }
-	
-  // resulting "scores" are now in [-2 best .. 0 worst]	
-  // we have to add +2 to the scores to obtain the chi square score
-  
-  // sort vector in ascending order of score
-  std::sort(ret.begin(), ret.end());
-  // (ret is inverted now --the lower the better--)
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
-  // complete and scale score to [0 worst .. 1 best]
-  QueryResults::iterator qit;
-  for(qit = ret.begin(); qit != ret.end(); qit++)
-  {
-    // this takes the 4 into account
-    qit->Score = - 2. * qit->Score; // [0..1]
-    
-    qit->chiScore = qit->Score;
-  }
-  
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryKL(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+inline void TemplatedDatabase<TDescriptor, F>::countRow(RowReader &row, 
+  const WordQuery *first, const WordQuery *last, unsigned int step)
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-  
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+  const WordQuery *qit;
+  typename RowReader::Segment seg;
   
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
-  {
-    const WordId word_id = vit->first;
-    const WordValue& vi = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {    
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& wi = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value = 0;
-        if(vi != 0 && wi != 0) value = vi * log(vi/wi);
-        
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
-	
-  // resulting "scores" are now in [-X worst .. 0 best .. X worst]
-  // but we cannot make sure which ones are better without calculating
-  // the complete score
-
-  // complete scores and move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  while(row.next(seg))
   {
-    EntryId eid = pit->first;
-    double value = 0.0;
-
-    for(vit = vec.begin(); vit != vec.end(); ++vit)
+    for(unsigned int i = row.start(step); i < seg.size; i += step)
     {
-      const WordValue &vi = vit->second;
-      const IFRow& row = m_ifile[vit->first];
-
-      if(vi != 0)
-      {
-        if(row.end() == find(row.begin(), row.end(), eid ))
-        {
-          value += vi * (log(vi) - GeneralScoring::LOG_EPS);
-        }
-      }
+      const EntryId entry_id = 
+        (seg.pairs != NULL ? seg.pairs[i].entry_id : seg.ids[i]);
+      
+      for(qit = first; qit != last; ++qit)
+        qit->acc->count(entry_id);
     }
-    
-    pit->second += value;
-    
-    // to vector
-    ret.push_back(Result(pit->first, pit->second));
   }
-  
-  // real scores are now in [0 best .. X worst]
-
-  // sort vector in ascending order
-  // (scores are inverted now --the lower the better--)
-  std::sort(ret.begin(), ret.end());
+}
 
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
+// --------------------------------------------------------------------------
 
-  // cannot scale scores
-    
+template<class TDescriptor, class F>
+inline typename TemplatedDatabase<TDescriptor, F>::ResultOrder
+TemplatedDatabase<TDescriptor, F>::resultOrder() const
+{
+  switch(m_voc->getScoringType())
+  {
+    case BHATTACHARYYA:
+    case DOT_PRODUCT:
+      // the greater the better
+      return &Result::gtScoreId;
+      
+    default:
+      // the lower the better (the scores of L1, L2 and chi square are 
+      // inverted until the results are completed)
+      return &Result::ltScoreId;
+  }
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryBhattacharyya(
-  const BowVector &vec, QueryResults &ret, int max_results, int max_id) const
+void TemplatedDatabase<TDescriptor, F>::select(const BowVector &vec, 
+  const ScoreAccumulator &acc, QueryResults &ret, int max_results,
+  const std::vector<unsigned int> &steps, int min_common_words) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
+  const ResultOrder better = resultOrder();
   
-  //map<EntryId, double> pairs;
-  //map<EntryId, double>::iterator pit;
+  // erased entries are skipped
+  const bool any_erased = (m_nerased.load() > 0);
   
-  std::map<EntryId, std::pair<double, int> > pairs; // <eid, <score, counter> >
-  std::map<EntryId, std::pair<double, int> >::iterator pit;
+  // entries with fewer common words were not scored
+  const int min_words = minCommonWords(min_common_words);
   
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  const std::vector<EntryId> &entries = acc.touched();
+  std::vector<EntryId>::const_iterator eit;
+  BowVector::const_iterator vit;
+  
+  ret.reserve(max_results > 0 ? 
+    std::min((size_t)max_results, entries.size()) : entries.size());
+  
+  switch(m_voc->getScoringType())
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
+    case L1_NORM:
+      // resulting "scores" are in [-2 best .. 0 worst]
+    case L2_NORM:
+      // resulting "scores" are in [-1 best .. 0 worst]
+    case DOT_PRODUCT:
+      // scores are the greater the better
+      for(eit = entries.begin(); eit != entries.end(); ++eit)
+      {
+        if(any_erased && isErased(*eit)) continue;
+        
+        ret.pushBest(Result(*eit, acc.score(*eit)), max_results, better);
+      }
+      break;
       
-      if((int)entry_id < max_id || max_id == -1)
+    case CHI_SQUARE:
+      // resulting "scores" are in [-2 best .. 0 worst]	
+      // we have to add +2 to the scores to obtain the chi square score
+      for(eit = entries.begin(); eit != entries.end(); ++eit)
       {
-        double value = sqrt(qvalue * dvalue);
+        const EntryId entry_id = *eit;
+        const int nwords = (int)acc.words(entry_id);
+        
+        if(any_erased && isErased(entry_id)) continue;
         
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
+        if(nwords >= min_words)
         {
-          pit->second.first += value;
-          pit->second.second += 1;
+          Result r(entry_id, acc.score(entry_id));
+          r.nWords = nwords;
+          r.sumCommonVi = acc.sumVi(entry_id);
+          r.sumCommonWi = acc.sumWi(entry_id);
+          r.expectedChiScore = 2 * r.sumCommonWi / (1 + r.sumCommonWi);
+          
+          ret.pushBest(r, max_results, better);
         }
-        else
+      }
+      break;
+      
+    case KL:
+      // the accumulated scores only replace the penalties of the missing
+      // words by the terms of the common ones (see KLKernel), so the
+      // penalty of all the query words is added to complete them
+      {
+        double missing = 0;
+        
+        size_t k = 0;
+        for(vit = vec.begin(); vit != vec.end(); ++vit, ++k)
+        {
+          // stop words skipped are not part of the query
+          if(!steps.empty() && steps[k] == 0) continue;
+          
+          const WordValue &vi = vit->second;
+          if(vi != 0) missing += vi * (log(vi) - GeneralScoring::LOG_EPS);
+        }
+        
+        for(eit = entries.begin(); eit != entries.end(); ++eit)
         {
-          pairs.insert(pit, 
-            std::map<EntryId, std::pair<double, int> >::value_type(entry_id,
-              std::make_pair(value, 1)));
+          if(any_erased && isErased(*eit)) continue;
+          
+          // real scores are now in [0 best .. X worst]
+          ret.pushBest(Result(*eit, acc.score(*eit) + missing), max_results,
+            better);
         }
       }
+      break;
       
-    } // for each inverted row
-  } // for each query word
-	
-  // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
-  {
-    if(pit->second.second >= MIN_COMMON_WORDS)
-    {
-      ret.push_back(Result(pit->first, pit->second.first));
-      ret.back().nWords = pit->second.second;
-      ret.back().bhatScore = pit->second.first;
-    }
+    case BHATTACHARYYA:
+      // scores are already in [0..1]
+      for(eit = entries.begin(); eit != entries.end(); ++eit)
+      {
+        const EntryId entry_id = *eit;
+        const int nwords = (int)acc.words(entry_id);
+        
+        if(any_erased && isErased(entry_id)) continue;
+        
+        if(nwords >= min_words)
+        {
+          Result r(entry_id, acc.score(entry_id));
+          r.nWords = nwords;
+          r.bhatScore = r.Score;
+          
+          ret.pushBest(r, max_results, better);
+        }
+      }
+      break;
   }
-	
-  // scores are already in [0..1]
-
-  // sort vector in descending order
-  std::sort(ret.begin(), ret.end(), Result::gt);
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
 }
 
-// ---------------------------------------------------------------------------
+// --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryDotProduct(
-  const BowVector &vec, QueryResults &ret, int max_results, int max_id) const
+void TemplatedDatabase<TDescriptor, F>::finish(QueryResults &ret, 
+  int max_results) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
+  // keep the best max_results, the best one first
+  ret.sortBest(max_results, resultOrder());
   
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+  QueryResults::iterator qit;
   
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  switch(m_voc->getScoringType())
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
+    case L1_NORM:
+      // (ret is inverted now --the lower the better--)
+      // complete and scale score to [0 worst .. 1 best]
+      // ||v - w||_{L1} = 2 + Sum(|v_i - w_i| - |v_i| - |w_i|) 
+      //		for all i | v_i != 0 and w_i != 0 
+      // (Nister, 2006)
+      // scaled_||v - w||_{L1} = 1 - 0.5 * ||v - w||_{L1}
+      for(qit = ret.begin(); qit != ret.end(); qit++) 
+        qit->Score = -qit->Score/2.0;
+      break;
       
-      if((int)entry_id < max_id || max_id == -1)
+    case L2_NORM:
+      // (ret is inverted now --the lower the better--)
+      // complete and scale score to [0 worst .. 1 best]
+      // ||v - w||_{L2} = sqrt( 2 - 2 * Sum(v_i * w_i) 
+      //		for all i | v_i != 0 and w_i != 0 )
+      // (Nister, 2006)
+      for(qit = ret.begin(); qit != ret.end(); qit++) 
       {
-        double value; 
-        if(this->m_voc->getWeightingType() == BINARY)
-          value = 1;
+        if(qit->Score <= -1.0) // rounding error
+          qit->Score = 1.0;
         else
-          value = qvalue * dvalue;
+          qit->Score = 1.0 - sqrt(1.0 + qit->Score); // [0..1]
+          // the + sign is ok, it is due to - sign in 
+          // value = - qvalue * dvalue
+      }
+      break;
+      
+    case CHI_SQUARE:
+      // (ret is inverted now --the lower the better--)
+      // complete and scale score to [0 worst .. 1 best]
+      for(qit = ret.begin(); qit != ret.end(); qit++)
+      {
+        // this takes the 4 into account
+        qit->Score = - 2. * qit->Score; // [0..1]
         
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-        }
+        qit->chiScore = qit->Score;
       }
+      break;
       
-    } // for each inverted row
-  } // for each query word
-	
-  // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
-  {
-    ret.push_back(Result(pit->first, pit->second));
+    case KL:
+      // (scores are inverted --the lower the better--)
+      // cannot scale scores
+      break;
+      
+    case BHATTACHARYYA:
+      // scores are already in [0..1]
+      break;
+      
+    case DOT_PRODUCT:
+      // these scores cannot be scaled
+      break;
   }
-	
-  // scores are the greater the better
-
-  // sort vector in descending order
-  std::sort(ret.begin(), ret.end(), Result::gt);
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
-  // these scores cannot be scaled
 }
 
 // ---------------------------------------------------------------------------
@@ -1122,7 +4183,7 @@ const FeatureVector& TemplatedDatabase<TDescriptor, F>::retrieveFeatures
   (EntryId id) const
 {
   assert(id < size());
-  return m_dfile[id];
+  return m_dfile[id].get();
 }
 
 // --------------------------------------------------------------------------
@@ -1149,6 +4210,8 @@ void TemplatedDatabase<TDescriptor, F>::save(cv::FileStorage &fs,
   //   nEntries: 
   //   usingDI: 
   //   diLevels: 
+  //   usingFI:
+  //   erasedEntries: [ ]
   //   invertedIndex
   //   [
   //     [
@@ -1171,31 +4234,59 @@ void TemplatedDatabase<TDescriptor, F>::save(cv::FileStorage &fs,
   // invertedIndex[i] is for the i-th word
   // directIndex[i] is for the i-th entry
   // directIndex may be empty if not using direct index
+  // erased entries have no postings nor features
   //
   // imageId's and nodeId's must be stored in ascending order
   // (according to the construction of the indexes)
 
+  // entries added while saving are ignored
+  MemoryReclaimer::ReadGuard guard(m_reclaimer);
+  const int nentries = m_nentries.load(std::memory_order_acquire);
+
   m_voc->save(fs);
  
   fs << name << "{";
   
-  fs << "nEntries" << m_nentries;
+  fs << "nEntries" << nentries;
   fs << "usingDI" << (m_use_di ? 1 : 0);
   fs << "diLevels" << m_dilevels;
+  fs << "usingFI" << (m_use_fi ? 1 : 0);
+  
+  std::vector<int> erased;
+  for(int eid = 0; m_nerased.load() > 0 && eid < nentries; ++eid)
+  {
+    if(isErased(eid)) erased.push_back(eid);
+  }
+  fs << "erasedEntries" << "[" << erased << "]";
+  
+  std::vector<double> timestamps(nentries);
+  for(int eid = 0; eid < nentries; ++eid)
+  {
+    timestamps[eid] = m_info[eid].timestamp;
+  }
+  fs << "timestamps" << "[" << timestamps << "]";
   
   fs << "invertedIndex" << "[";
   
-  typename InvertedFile::const_iterator iit;
   typename IFRow::const_iterator irit;
-  for(iit = m_ifile.begin(); iit != m_ifile.end(); ++iit)
+  for(WordId word_id = 0; word_id < m_ifile.size(); ++word_id)
   {
+    RowReader row(*this, word_id, 0, nentries);
+    typename IFRow::Snapshot seg(NULL, NULL);
+    
     fs << "["; // word of IF
-    for(irit = iit->begin(); irit != iit->end(); ++irit)
+    while(row.next(seg))
     {
-      fs << "{:" 
-        << "imageId" << (int)irit->entry_id
-        << "weight" << irit->word_weight
-        << "}";
+      for(irit = seg.begin(); irit != seg.end(); ++irit)
+      {
+        if(isErased(irit->entry_id)) continue;
+        
+        fs << "{:" 
+          << "imageId" << (int)irit->entry_id
+          << "weight" << postingWeight(
+            dequantize(irit->word_weight, seg.header()))
+          << "}";
+      }
     }
     fs << "]"; // word of IF
   }
@@ -1204,24 +4295,26 @@ void TemplatedDatabase<TDescriptor, F>::save(cv::FileStorage &fs,
   
   fs << "directIndex" << "[";
   
-  typename DirectFile::const_iterator dit;
   typename FeatureVector::const_iterator drit;
-  for(dit = m_dfile.begin(); dit != m_dfile.end(); ++dit)
+  for(int eid = 0; m_use_di && eid < nentries; ++eid)
   {
+    const FeatureVector &fv = m_dfile[eid].get();
+    
     fs << "["; // entry of DF
     
-    for(drit = dit->begin(); drit != dit->end(); ++drit)
+    for(drit = fv.begin(); drit != fv.end() && !isErased(eid); ++drit)
     {
       NodeId nid = drit->first;
-      const std::vector<unsigned int>& features = drit->second;
+      const FeatureVector::Features features = drit->second;
+      
+      // msvc++ 2010 with opencv 2.3.1 does not allow FileStorage::operator<<
+      // with vectors of unsigned int
+      std::vector<int> aux(features.begin(), features.end());
       
       // save info of last_nid
       fs << "{";
       fs << "nodeId" << (int)nid;
-      // msvc++ 2010 with opencv 2.3.1 does not allow FileStorage::operator<<
-      // with vectors of unsigned int
-      fs << "features" << "[" 
-        << *(const std::vector<int>*)(&features) << "]";
+      fs << "features" << "[" << aux << "]";
       fs << "}";
     }
     
@@ -1251,31 +4344,73 @@ void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
   const std::string &name)
 { 
   // load voc first
-  // subclasses must instantiate m_voc before calling this ::load
-  if(!m_voc) m_voc = new TemplatedVocabulary<TDescriptor, F>;
+  // a new vocabulary is created, since the current one may be shared
+  TemplatedVocabulary<TDescriptor, F> *voc = 
+    new TemplatedVocabulary<TDescriptor, F>;
+  m_voc.reset(voc);
+  
+  voc->load(fs);
+
+  loadEntries(fs, name);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
+  const std::shared_ptr<T> &voc, const std::string &name)
+{
+  voc->load(fs);
+  m_voc = voc;
   
-  m_voc->load(fs);
+  loadEntries(fs, name);
+}
+
+// --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::loadEntries(
+  const cv::FileStorage &fs, const std::string &name)
+{
   // load database now
   clear(); // resizes inverted file 
     
   cv::FileNode fdb = fs[name];
   
-  m_nentries = (int)fdb["nEntries"]; 
+  m_nentries.store((int)fdb["nEntries"]); 
   m_use_di = (int)fdb["usingDI"] != 0;
   m_dilevels = (int)fdb["diLevels"];
   
+  // erased entries (absent in old files)
+  m_erased.resize(m_nentries);
+  cv::FileNode fe = fdb["erasedEntries"][0];
+  for(unsigned int i = 0; i < fe.size(); ++i)
+  {
+    m_erased[(int)fe[i]].store(1);
+  }
+  m_nerased.store(fe.size());
+  
+  // timestamps (absent in old files)
+  m_info.resize(m_nentries);
+  cv::FileNode ft = fdb["timestamps"][0];
+  for(unsigned int i = 0; i < ft.size() && (int)i < m_nentries; ++i)
+  {
+    m_info[i].timestamp = (double)ft[i];
+  }
+  
   cv::FileNode fn = fdb["invertedIndex"];
   for(WordId wid = 0; wid < fn.size(); ++wid)
   {
     cv::FileNode fw = fn[wid];
     
+    m_ifile[wid].reserve(fw.size(), m_reclaimer);
     for(unsigned int i = 0; i < fw.size(); ++i)
     {
       EntryId eid = (int)fw[i]["imageId"];
       WordValue v = fw[i]["weight"];
       
-      m_ifile[wid].push_back(IFPair(eid, v));
+      appendPosting(wid, eid, postingValue(v));
     }
   }
   
@@ -1286,19 +4421,17 @@ void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
     m_dfile.resize(fn.size());
     assert(m_nentries == (int)fn.size());
     
-    FeatureVector::iterator dit;
+    std::vector<std::pair<NodeId, unsigned int> > nodes;
+    FeatureVector fv;
     for(EntryId eid = 0; eid < fn.size(); ++eid)
     {
       cv::FileNode fe = fn[eid];
       
-      m_dfile[eid].clear();
+      nodes.resize(0);
       for(unsigned int i = 0; i < fe.size(); ++i)
       {
         NodeId nid = (int)fe[i]["nodeId"];
         
-        dit = m_dfile[eid].insert(m_dfile[eid].end(), 
-          make_pair(nid, std::vector<unsigned int>() ));
-        
         // this failed to compile with some opencv versions (2.3.1)
         //fe[i]["features"] >> dit->second;
         
@@ -1309,17 +4442,22 @@ void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
         //std::copy(aux.begin(), aux.end(), dit->second.begin());
         
         cv::FileNode ff = fe[i]["features"][0];
-        dit->second.reserve(ff.size());
                 
         cv::FileNodeIterator ffit;
         for(ffit = ff.begin(); ffit != ff.end(); ++ffit)
         {
-          dit->second.push_back((int)*ffit); 
+          nodes.push_back(std::make_pair(nid, (unsigned int)(int)*ffit)); 
         }
       }
+      
+      fv.setFeatures(nodes);
+      m_dfile[eid].assign(fv, m_reclaimer);
     } // for each entry
   } // if use_id
   
+  // the forward index is not stored. This also computes the memory of the
+  // entries
+  setForwardIndex((int)fdb["usingFI"] != 0);
 }
 
 // --------------------------------------------------------------------------
@@ -0,0 +1,411 @@
+/**
+ * File: TemplatedMatcher.h
+ * Date: October 2026
+ * Description: descriptor matching guided by feature vectors
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_TEMPLATED_MATCHER__
+#define __D_T_TEMPLATED_MATCHER__
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <functional>
+#include <cstdint>
+#include <climits>
+
+#include "FeatureVector.h"
+#include "FORB.h"
+#include "ThreadPool.h"
+
+namespace DBoW2 {
+
+/// Match between the features of two images
+class FeatureMatch
+{
+public:
+
+  /// Index of the feature in the first image
+  unsigned int first;
+
+  /// Index of the feature in the second image
+  unsigned int second;
+
+  /// Distance between their descriptors
+  double distance;
+
+  /**
+   * Empty constructor
+   */
+  inline FeatureMatch(){}
+
+  /**
+   * Creates a match with the given data
+   * @param i1 index of the feature in the first image
+   * @param i2 index of the feature in the second image
+   * @param d distance
+   */
+  inline FeatureMatch(unsigned int i1, unsigned int i2, double d):
+    first(i1), second(i2), distance(d) {}
+};
+
+/// Distance between descriptors, F::distance by default
+template<class TDescriptor, class F>
+class MatchDistance
+{
+public:
+
+  /**
+   * Calculates the distance between two descriptors
+   * @param a
+   * @param b
+   * @return distance
+   */
+  static inline double compute(const TDescriptor &a, const TDescriptor &b)
+  {
+    return F::distance(a, b);
+  }
+};
+
+/// Hamming distance between ORB descriptors, inlined in the matching loop
+template<>
+class MatchDistance<FORB::TDescriptor, FORB>
+{
+public:
+
+  /**
+   * Calculates the distance between two descriptors
+   * @param a
+   * @param b
+   * @return number of different bits
+   */
+  static inline double compute(const FORB::TDescriptor &a,
+    const FORB::TDescriptor &b)
+  {
+    const uint64_t *pa = a.ptr<uint64_t>(); // a & b are actually CV_8U
+    const uint64_t *pb = b.ptr<uint64_t>();
+
+    int ret = 0;
+    for(int i = 0; i < FORB::L / (int)sizeof(uint64_t); ++i)
+    {
+#if defined(__GNUC__)
+      ret += __builtin_popcountll(pa[i] ^ pb[i]);
+#else
+      uint64_t v = pa[i] ^ pb[i];
+      v = v - ((v >> 1) & (uint64_t)~(uint64_t)0/3);
+      v = (v & (uint64_t)~(uint64_t)0/15*3) + ((v >> 2) &
+        (uint64_t)~(uint64_t)0/15*3);
+      v = (v + (v >> 4)) & (uint64_t)~(uint64_t)0/255*15;
+      ret += (int)((uint64_t)(v * ((uint64_t)~(uint64_t)0/255)) >>
+        (sizeof(uint64_t) - 1) * CHAR_BIT);
+#endif
+    }
+    return ret;
+  }
+};
+
+/// Matches the features of two images that share nodes of the vocabulary
+/**
+ * Only the features that fall in the same node of two feature vectors
+ * (obtained with the same levelsup) are compared. The nodes in common are
+ * found by walking both vectors at once, since their node ids are sorted.
+ * Each feature of the first image is matched to its nearest feature of
+ * the second one in its node, if this is close enough and clearly closer
+ * than the second nearest one (ratio test). The threads of a matcher 
+ * are created by its first large matching and reused by the next ones.
+ */
+template<class TDescriptor, class F>
+class TemplatedMatcher
+{
+public:
+
+  /// Largest distance of a match. A value <= 0 is not applied
+  double max_distance;
+
+  /// Nearest distance must be lower than ratio times the second nearest
+  /// one. A value <= 0 or >= 1 is not applied
+  double ratio;
+
+  /// If true, each feature of the second image is matched at most once,
+  /// to the closest feature of the first image
+  bool unique;
+
+  /// Number of threads to use. A value <= 0 means one per core. Small
+  /// matchings run on the calling thread only
+  int threads;
+
+public:
+
+  /**
+   * Creates a matcher
+   * @param _max_distance largest distance of a match
+   * @param _ratio ratio of the nearest to the second nearest distances
+   * @param _unique whether each feature of the second image is matched
+   *   once only
+   * @param _threads number of threads
+   */
+  TemplatedMatcher(double _max_distance = 0, double _ratio = 0.8,
+    bool _unique = true, int _threads = 1):
+    max_distance(_max_distance), ratio(_ratio), unique(_unique),
+    threads(_threads) {}
+
+  /**
+   * Copies the settings of a matcher, but not its threads
+   * @param m
+   */
+  TemplatedMatcher(const TemplatedMatcher<TDescriptor, F> &m):
+    max_distance(m.max_distance), ratio(m.ratio), unique(m.unique),
+    threads(m.threads) {}
+
+  /**
+   * Copies the settings of a matcher, but not its threads
+   * @param m
+   * @return this
+   */
+  TemplatedMatcher<TDescriptor, F>& operator=(
+    const TemplatedMatcher<TDescriptor, F> &m)
+  {
+    max_distance = m.max_distance;
+    ratio = m.ratio;
+    unique = m.unique;
+    threads = m.threads;
+    return *this;
+  }
+
+  /**
+   * Matches the features of two images
+   * @param fv1 feature vector of the first image
+   * @param d1 descriptors of the first image
+   * @param fv2 feature vector of the second image
+   * @param d2 descriptors of the second image
+   * @param matches (out) matches, sorted by the index of the feature of
+   *   the first image
+   */
+  void match(const FeatureVector &fv1, const std::vector<TDescriptor> &d1,
+    const FeatureVector &fv2, const std::vector<TDescriptor> &d2,
+    std::vector<FeatureMatch> &matches) const;
+
+protected:
+
+  /// Features of a node in both images
+  typedef std::pair<FeatureVector::Features, FeatureVector::Features>
+    NodePair;
+
+  /// Nearest features found for a feature of the first image
+  struct Candidate
+  {
+    /// Index of the nearest feature, or -1
+    int best;
+    /// Distance to the nearest feature
+    double best_distance;
+    /// Distance to the second nearest feature
+    double second_distance;
+  };
+
+  /**
+   * Finds the nearest features of the first image in some nodes
+   * @param pairs nodes in common
+   * @param first first node to process
+   * @param last end of the nodes to process
+   * @param d1 descriptors of the first image
+   * @param d2 descriptors of the second image
+   * @param candidates (in/out) nearest features, by feature of the first
+   *   image. Only the features of the given nodes are written
+   */
+  void matchNodes(const std::vector<NodePair> &pairs, size_t first,
+    size_t last, const std::vector<TDescriptor> &d1,
+    const std::vector<TDescriptor> &d2,
+    std::vector<Candidate> &candidates) const;
+
+  /**
+   * Finds the nearest features of the first image in one of the parts of
+   * the nodes matched on several threads
+   * @param pairs nodes in common
+   * @param bounds first node of each part, and the end of the last one
+   * @param d1 descriptors of the first image
+   * @param d2 descriptors of the second image
+   * @param candidates (in/out) nearest features
+   * @param t part to process
+   */
+  void matchPart(const std::vector<NodePair> &pairs, 
+    const std::vector<size_t> &bounds, const std::vector<TDescriptor> &d1,
+    const std::vector<TDescriptor> &d2, std::vector<Candidate> &candidates,
+    unsigned int t) const;
+
+  /// Minimum number of distances computed per thread
+  static const size_t MIN_THREAD_DISTANCES = 1 << 14;
+
+  /// Threads that run the parts of large matchings
+  mutable ThreadPool m_workers;
+};
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::match(
+  const FeatureVector &fv1, const std::vector<TDescriptor> &d1,
+  const FeatureVector &fv2, const std::vector<TDescriptor> &d2,
+  std::vector<FeatureMatch> &matches) const
+{
+  matches.clear();
+
+  // nodes in common, and the distances needed up to each one
+  std::vector<NodePair> pairs;
+  std::vector<size_t> cost(1, 0);
+
+  FeatureVector::const_iterator it1 = fv1.begin(), it2 = fv2.begin();
+  while(it1 != fv1.end() && it2 != fv2.end())
+  {
+    if(it1->first == it2->first)
+    {
+      const FeatureVector::Node n1 = *it1, n2 = *it2;
+      pairs.push_back(NodePair(n1.second, n2.second));
+      cost.push_back(cost.back() + n1.second.size() * n2.second.size());
+      ++it1;
+      ++it2;
+    }
+    else if(it1->first < it2->first)
+    {
+      it1 = fv1.lower_bound(it2->first);
+    }
+    else
+    {
+      it2 = fv2.lower_bound(it1->first);
+    }
+  }
+
+  if(pairs.empty()) return;
+
+  std::vector<Candidate> candidates(d1.size());
+  for(size_t i = 0; i < candidates.size(); ++i) candidates[i].best = -1;
+
+  int nthreads = threads;
+  if(nthreads <= 0) nthreads = (int)std::thread::hardware_concurrency();
+  if((size_t)nthreads > cost.back() / MIN_THREAD_DISTANCES)
+    nthreads = (int)(cost.back() / MIN_THREAD_DISTANCES);
+
+  if(nthreads <= 1)
+  {
+    matchNodes(pairs, 0, pairs.size(), d1, d2, candidates);
+  }
+  else
+  {
+    // the nodes are split so that the threads compute a similar number of
+    // distances. A feature of the first image belongs to one node only, so
+    // the threads write different candidates
+    std::vector<size_t> bounds(nthreads + 1, pairs.size());
+    bounds[0] = 0;
+    for(int t = 1; t < nthreads; ++t)
+    {
+      bounds[t] = std::lower_bound(cost.begin(), cost.end(),
+        cost.back() * t / nthreads) - cost.begin();
+      if(bounds[t] > pairs.size()) bounds[t] = pairs.size();
+    }
+
+    m_workers.run(nthreads, std::bind(
+      &TemplatedMatcher<TDescriptor, F>::matchPart, this, std::cref(pairs),
+      std::cref(bounds), std::cref(d1), std::cref(d2), 
+      std::ref(candidates), std::placeholders::_1));
+  }
+
+  // apply the thresholds
+  const bool test_ratio = (ratio > 0 && ratio < 1);
+  std::vector<int> owner; // match of each feature of the second image
+  if(unique) owner.resize(d2.size(), -1);
+
+  for(size_t i1 = 0; i1 < candidates.size(); ++i1)
+  {
+    const Candidate &c = candidates[i1];
+    if(c.best < 0) continue;
+    if(max_distance > 0 && c.best_distance > max_distance) continue;
+    if(test_ratio && !(c.best_distance < ratio * c.second_distance))
+      continue;
+
+    if(unique)
+    {
+      int &o = owner[c.best];
+      if(o >= 0)
+      {
+        // keep the closest feature, or the first one on ties
+        if(matches[o].distance <= c.best_distance) continue;
+        matches[o].second = UINT_MAX; // removed below
+      }
+      o = (int)matches.size();
+    }
+
+    matches.push_back(FeatureMatch((unsigned int)i1, (unsigned int)c.best,
+      c.best_distance));
+  }
+
+  if(unique)
+  {
+    size_t n = 0;
+    for(size_t i = 0; i < matches.size(); ++i)
+      if(matches[i].second != UINT_MAX) matches[n++] = matches[i];
+    matches.resize(n);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::matchNodes(
+  const std::vector<NodePair> &pairs, size_t first, size_t last,
+  const std::vector<TDescriptor> &d1, const std::vector<TDescriptor> &d2,
+  std::vector<Candidate> &candidates) const
+{
+  for(size_t p = first; p < last; ++p)
+  {
+    const FeatureVector::Features &f1 = pairs[p].first;
+    const FeatureVector::Features &f2 = pairs[p].second;
+
+    for(size_t i = 0; i < f1.size(); ++i)
+    {
+      const TDescriptor &a = d1[f1[i]];
+
+      int best = -1;
+      double best_distance = std::numeric_limits<double>::max();
+      double second_distance = std::numeric_limits<double>::max();
+
+      for(size_t j = 0; j < f2.size(); ++j)
+      {
+        const double d = MatchDistance<TDescriptor, F>::compute(a, d2[f2[j]]);
+        if(d < best_distance)
+        {
+          second_distance = best_distance;
+          best_distance = d;
+          best = (int)f2[j];
+        }
+        else if(d < second_distance)
+        {
+          second_distance = d;
+        }
+      }
+
+      Candidate &c = candidates[f1[i]];
+      c.best = best;
+      c.best_distance = best_distance;
+      c.second_distance = second_distance;
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::matchPart(
+  const std::vector<NodePair> &pairs, const std::vector<size_t> &bounds,
+  const std::vector<TDescriptor> &d1, const std::vector<TDescriptor> &d2,
+  std::vector<Candidate> &candidates, unsigned int t) const
+{
+  matchNodes(pairs, bounds[t], bounds[t+1], d1, d2, candidates);
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
@@ -22,6 +22,7 @@
 #include "FeatureVector.h"
 #include "BowVector.h"
 #include "ScoringObject.h"
+#include "TransformContext.h"
 
 #include <DUtils/DUtils.h>
 
@@ -135,6 +136,30 @@ public:
   virtual void transform(const std::vector<TDescriptor>& features,
     BowVector &v, FeatureVector &fv, int levelsup) const;
 
+  /**
+   * Transforms a set of descriptors into a bow vector, using the buffers of
+   * the given context. The other transforms use a context of the calling 
+   * thread
+   * @param features
+   * @param v (out) bow vector of weighted words
+   * @param ctx context that provides the scratch memory
+   */
+  void transform(const std::vector<TDescriptor>& features, BowVector &v,
+    TransformContext &ctx) const;
+  
+  /**
+   * Transforms a set of descriptors into a bow vector and a feature vector,
+   * using the buffers of the given context
+   * @param features
+   * @param v (out) bow vector
+   * @param fv (out) feature vector of nodes and feature indexes
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   * @param ctx context that provides the scratch memory
+   */
+  void transform(const std::vector<TDescriptor>& features,
+    BowVector &v, FeatureVector &fv, int levelsup, 
+    TransformContext &ctx) const;
+
   /**
    * Transforms a single feature into a word (without weight)
    * @param feature
@@ -160,6 +185,52 @@ public:
    */
   virtual NodeId getParentNode(WordId wid, int levelsup) const;
   
+  /**
+   * Builds the feature vector of some features from their word ids, as 
+   * transform does from their descriptors
+   * @param words word id of each feature
+   * @param fv (out) feature vector
+   * @param levelsup levels to go up the vocabulary tree to get the node 
+   *   index
+   */
+  void getFeatureVector(const std::vector<WordId> &words, FeatureVector &fv,
+    int levelsup) const;
+
+  /**
+   * Builds the feature vector of some features from their word ids, using
+   * the buffers of the given context
+   * @param words word id of each feature
+   * @param fv (out) feature vector
+   * @param levelsup levels to go up the vocabulary tree to get the node 
+   *   index
+   * @param ctx context that provides the scratch memory
+   */
+  void getFeatureVector(const std::vector<WordId> &words, FeatureVector &fv,
+    int levelsup, TransformContext &ctx) const;
+  
+  /**
+   * Moves the nodes of a feature vector up the vocabulary tree, so that it
+   * is the same as if it had been obtained with a greater levelsup
+   * @param fv feature vector obtained with levelsup
+   * @param levelsup levels up of fv
+   * @param new_levelsup levels up of the new vector (>= levelsup)
+   * @param out (out) feature vector. It can be fv
+   */
+  void relevelFeatureVector(const FeatureVector &fv, int levelsup, 
+    int new_levelsup, FeatureVector &out) const;
+
+  /**
+   * Moves the nodes of a feature vector up the vocabulary tree, using the 
+   * buffers of the given context
+   * @param fv feature vector obtained with levelsup
+   * @param levelsup levels up of fv
+   * @param new_levelsup levels up of the new vector (>= levelsup)
+   * @param out (out) feature vector. It can be fv
+   * @param ctx context that provides the scratch memory
+   */
+  void relevelFeatureVector(const FeatureVector &fv, int levelsup, 
+    int new_levelsup, FeatureVector &out, TransformContext &ctx) const;
+  
   /**
    * Returns the ids of all the words that are under the given node id,
    * by traversing any of the branches that goes down from the node
@@ -168,6 +239,28 @@ public:
    */
   void getWordsFromNode(NodeId nid, std::vector<WordId> &words) const;
   
+  /**
+   * Returns the range of ids of the words under the given node id. This is
+   * only available when the words under every node have consecutive ids,
+   * as after renumberWords
+   * @param nid node id
+   * @param first (out) first word id
+   * @param last (out) word id after the last one
+   * @return true iff the range is available
+   */
+  inline bool getWordsFromNode(NodeId nid, WordId &first, WordId &last) 
+    const;
+  
+  /**
+   * Assigns the word ids in depth-first order, so that the words under 
+   * any node have consecutive ids. This should be done right after 
+   * creating or loading the vocabulary, since the bow vectors and the
+   * databases obtained with the old ids are no longer valid
+   * @param new_ids (out) if given, the new id of each old word id, to 
+   *   renumber old bow vectors (see BowVector::renumber)
+   */
+  void renumberWords(std::vector<WordId> *new_ids = NULL);
+  
   /**
    * Returns the branching factor of the tree (k)
    * @return k
@@ -313,6 +406,13 @@ protected:
    */
   void createScoringObject();
 
+  /**
+   * Returns the context used by the transforms of the calling thread that
+   * are not given one
+   * @return context of the thread
+   */
+  static TransformContext& threadContext();
+
   /** 
    * Returns a set of pointers to descriptores
    * @param training_features all the features
@@ -339,6 +439,18 @@ protected:
    * @param id (out) word id
    */
   virtual void transform(const TDescriptor &feature, WordId &id) const;
+  
+  /**
+   * Builds a bow vector from the words of some features, merging repeated
+   * words and weighting and normalizing them
+   * @param words (in/out) <word id, weight> pairs of the features, in any
+   *   order. They are sorted
+   * @param v (out) bow vector
+   * @param must whether the vector must be normalized
+   * @param norm norm to normalize with
+   */
+  void finishBowVector(std::vector<std::pair<WordId, WordValue> > &words,
+    BowVector &v, bool must, LNorm norm) const;
       
   /**
    * Creates a level in the tree, under the parent, by running kmeans with
@@ -372,6 +484,27 @@ protected:
    */
   void createWords();
   
+  /**
+   * Creates the table of the ancestors of the words once the words have
+   * been created
+   */
+  void createAncestors();
+  
+  /**
+   * Returns the ancestor of a word at some level
+   * @param wid word id
+   * @param level level of the ancestor (0: root)
+   * @return node id of the ancestor, or of the word if it is not deeper
+   *   than the level
+   */
+  inline NodeId getAncestor(WordId wid, int level) const;
+  
+  /**
+   * Creates the range of word ids of each node if the words under every
+   * node have consecutive ids, once the ancestors have been created
+   */
+  void createWordRanges();
+  
   /**
    * Sets the weights of the nodes of tree according to the given features.
    * Before calling this function, the nodes and the words must be already
@@ -404,6 +537,17 @@ protected:
   /// this condition holds: m_words[wid]->word_id == wid
   std::vector<Node*> m_words;
   
+  /// Ancestors of the words at the levels 1..L-1. The ancestor of word 
+  /// wid at level l is m_ancestors[(l-1) * number of words + wid]
+  std::vector<NodeId> m_ancestors;
+  
+  /// Level of each word
+  std::vector<unsigned char> m_word_levels;
+  
+  /// [first, last) ids of the words under each node, if they are 
+  /// consecutive for all the nodes. Empty otherwise
+  std::vector<std::pair<WordId, WordId> > m_word_ranges;
+  
 };
 
 // --------------------------------------------------------------------------
@@ -915,6 +1059,41 @@ void TemplatedVocabulary<TDescriptor,F>::createWords()
       }
     }
   }
+  
+  createAncestors();
+  createWordRanges();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::createAncestors()
+{
+  m_ancestors.clear();
+  m_word_levels.clear();
+  
+  const size_t W = m_words.size();
+  if(W == 0) return;
+  
+  m_word_levels.resize(W);
+  if(m_L > 1) m_ancestors.resize((size_t)(m_L - 1) * W);
+  
+  std::vector<NodeId> path; // from the word up to level 1
+  for(size_t wid = 0; wid < W; ++wid)
+  {
+    path.clear();
+    for(NodeId nid = m_words[wid]->id; nid != 0; nid = m_nodes[nid].parent)
+      path.push_back(nid);
+    
+    const int depth = (int)path.size();
+    m_word_levels[wid] = (unsigned char)depth;
+    
+    for(int level = 1; level < m_L; ++level)
+    {
+      m_ancestors[(size_t)(level - 1) * W + wid] = 
+        (level < depth ? path[depth - level] : path[0]);
+    }
+  }
 }
 
 // --------------------------------------------------------------------------
@@ -1042,9 +1221,28 @@ WordId TemplatedVocabulary<TDescriptor, F>::transform
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+TransformContext& TemplatedVocabulary<TDescriptor,F>::threadContext()
+{
+  static thread_local TransformContext ctx;
+  return ctx;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::transform(
   const std::vector<TDescriptor>& features, BowVector &v) const
+{
+  transform(features, v, threadContext());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features, BowVector &v,
+  TransformContext &ctx) const
 {
   v.clear();
   
@@ -1057,48 +1255,25 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
 
-  typename std::vector<TDescriptor>::const_iterator fit;
+  // the words of the features are collected and merged at once
+  std::vector<std::pair<WordId, WordValue> > &words = ctx.words;
+  words.clear();
+  words.reserve(features.size());
 
-  if(m_weighting == TF || m_weighting == TF_IDF)
+  typename std::vector<TDescriptor>::const_iterator fit;
+  for(fit = features.begin(); fit < features.end(); ++fit)
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
-    {
-      WordId id;
-      WordValue w; 
-      // w is the idf value if TF_IDF, 1 if TF
-      
-      transform(*fit, id, w);
-      
-      // not stopped
-      if(w > 0) v.addWeight(id, w);
-    }
+    WordId id;
+    WordValue w; 
+    // w is the idf value if TF_IDF, idf if IDF, or 1 if TF or BINARY
     
-    if(!v.empty() && !must)
-    {
-      // unnecessary when normalizing
-      const double nd = v.size();
-      for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
-        vit->second /= nd;
-    }
+    transform(*fit, id, w);
     
+    // not stopped
+    if(w > 0) words.push_back(std::make_pair(id, w));
   }
-  else // IDF || BINARY
-  {
-    for(fit = features.begin(); fit < features.end(); ++fit)
-    {
-      WordId id;
-      WordValue w;
-      // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w);
-      
-      // not stopped
-      if(w > 0) v.addIfNotExist(id, w);
-      
-    } // if add_features
-  } // if m_weighting == ...
   
-  if(must) v.normalize(norm);
+  finishBowVector(words, v, must, norm);
 }
 
 // --------------------------------------------------------------------------
@@ -1107,6 +1282,17 @@ template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::transform(
   const std::vector<TDescriptor>& features,
   BowVector &v, FeatureVector &fv, int levelsup) const
+{
+  transform(features, v, fv, levelsup, threadContext());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features,
+  BowVector &v, FeatureVector &fv, int levelsup, 
+  TransformContext &ctx) const
 {
   v.clear();
   fv.clear();
@@ -1120,57 +1306,66 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
   
-  typename std::vector<TDescriptor>::const_iterator fit;
+  // <word, weight> and <node, feature> pairs, sorted at the end
+  std::vector<std::pair<WordId, WordValue> > &words = ctx.words;
+  std::vector<std::pair<NodeId, unsigned int> > &nodes = ctx.nodes;
+  words.clear();
+  nodes.clear();
+  words.reserve(features.size());
+  nodes.reserve(features.size());
   
-  if(m_weighting == TF || m_weighting == TF_IDF)
+  typename std::vector<TDescriptor>::const_iterator fit;
+  unsigned int i_feature = 0;
+  for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
-    {
-      WordId id;
-      NodeId nid;
-      WordValue w; 
-      // w is the idf value if TF_IDF, 1 if TF
-      
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
-      { 
-        v.addWeight(id, w);
-        fv.addFeature(nid, i_feature);
-      }
-    }
+    WordId id;
+    NodeId nid;
+    WordValue w; 
+    // w is the idf value if TF_IDF, idf if IDF, or 1 if TF or BINARY
     
-    if(!v.empty() && !must)
-    {
-      // unnecessary when normalizing
-      const double nd = v.size();
-      for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
-        vit->second /= nd;
+    transform(*fit, id, w, &nid, levelsup);
+    
+    if(w > 0) // not stopped
+    { 
+      words.push_back(std::make_pair(id, w));
+      nodes.push_back(std::make_pair(nid, i_feature));
     }
+  }
+  
+  // the feature indexes are increasing, so that sorting the pairs keeps 
+  // the features of each node in order, as setFeatures does
+  std::sort(nodes.begin(), nodes.end());
+  fv.setFeatures(nodes);
+  finishBowVector(words, v, must, norm);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::finishBowVector(
+  std::vector<std::pair<WordId, WordValue> > &words, BowVector &v, 
+  bool must, LNorm norm) const
+{
+  // term frequencies are added up for TF and TF_IDF, whereas IDF and
+  // BINARY keep one weight per word
+  const bool tf = (m_weighting == TF || m_weighting == TF_IDF);
+  
+  // all the pairs of a word have its same weight, so sorting them is the 
+  // same as the stable sort of setWords, without its temporary buffer
+  std::sort(words.begin(), words.end());
+  v.setWords(words, tf);
   
+  if(must)
+  {
+    v.normalize(norm);
   }
-  else // IDF || BINARY
+  else if(tf && !v.empty())
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
-    {
-      WordId id;
-      NodeId nid;
-      WordValue w;
-      // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
-      {
-        v.addIfNotExist(id, w);
-        fv.addFeature(nid, i_feature);
-      }
-    }
-  } // if m_weighting == ...
-  
-  if(must) v.normalize(norm);
+    // unnecessary when normalizing
+    const double nd = v.size();
+    for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
+      vit->second /= nd;
+  }
 }
 
 // --------------------------------------------------------------------------
@@ -1199,7 +1394,6 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
   WordId &word_id, WordValue &weight, NodeId *nid, int levelsup) const
 { 
   // propagate the feature down the tree
-  std::vector<NodeId> nodes;
   typename std::vector<NodeId>::const_iterator nit;
 
   // level at which the node must be stored in nid, if given
@@ -1212,7 +1406,7 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
   do
   {
     ++current_level;
-    nodes = m_nodes[final_id].children;
+    const std::vector<NodeId> &nodes = m_nodes[final_id].children;
     final_id = nodes[0];
  
     double best_d = F::distance(feature, m_nodes[final_id].descriptor);
@@ -1232,6 +1426,9 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
       *nid = final_id;
     
   } while( !m_nodes[final_id].isLeaf() );
+  
+  // the word is above the level of nid
+  if(nid != NULL && current_level < nid_level) *nid = final_id;
 
   // turn node id into word id
   word_id = m_nodes[final_id].word_id;
@@ -1244,13 +1441,188 @@ template<class TDescriptor, class F>
 NodeId TemplatedVocabulary<TDescriptor,F>::getParentNode
   (WordId wid, int levelsup) const
 {
-  NodeId ret = m_words[wid]->id; // node id
-  while(levelsup > 0 && ret != 0) // ret == 0 --> root
+  if(levelsup <= 0) return m_words[wid]->id;
+  return getAncestor(wid, (int)m_word_levels[wid] - levelsup);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::createWordRanges()
+{
+  m_word_ranges.clear();
+  if(m_words.empty()) return;
+  
+  // smallest and largest word id and number of words under each node
+  std::vector<std::pair<WordId, WordId> > ranges(m_nodes.size(), 
+    std::make_pair((WordId)m_words.size(), (WordId)0));
+  std::vector<unsigned int> nwords(m_nodes.size(), 0);
+  
+  for(WordId wid = 0; wid < m_words.size(); ++wid)
+  {
+    NodeId nid = m_words[wid]->id;
+    while(true)
+    {
+      std::pair<WordId, WordId> &r = ranges[nid];
+      if(wid < r.first) r.first = wid;
+      if(wid + 1 > r.second) r.second = wid + 1;
+      ++nwords[nid];
+      
+      if(nid == 0) break;
+      nid = m_nodes[nid].parent;
+    }
+  }
+  
+  for(size_t nid = 0; nid < m_nodes.size(); ++nid)
   {
-    --levelsup;
-    ret = m_nodes[ret].parent;
+    if(nwords[nid] > 0 && ranges[nid].second - ranges[nid].first != 
+      nwords[nid]) return; // not consecutive
   }
-  return ret;
+  
+  m_word_ranges.swap(ranges);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::renumberWords
+  (std::vector<WordId> *new_ids)
+{
+  if(new_ids) new_ids->resize(m_words.size());
+  if(m_words.empty()) return;
+  
+  std::vector<Node*> words;
+  words.reserve(m_words.size());
+  
+  // depth-first traversal, visiting the children in order
+  std::vector<NodeId> stack(1, 0);
+  while(!stack.empty())
+  {
+    Node &node = m_nodes[stack.back()];
+    stack.pop_back();
+    
+    if(node.isLeaf())
+    {
+      if(node.id == 0) continue; // empty tree
+      if(new_ids) (*new_ids)[node.word_id] = (WordId)words.size();
+      node.word_id = (WordId)words.size();
+      words.push_back(&node);
+    }
+    else
+    {
+      stack.insert(stack.end(), node.children.rbegin(), 
+        node.children.rend());
+    }
+  }
+  
+  m_words.swap(words);
+  createAncestors();
+  createWordRanges();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedVocabulary<TDescriptor,F>::getWordsFromNode
+  (NodeId nid, WordId &first, WordId &last) const
+{
+  if(m_word_ranges.empty()) return false;
+  first = m_word_ranges[nid].first;
+  last = m_word_ranges[nid].second;
+  return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline NodeId TemplatedVocabulary<TDescriptor,F>::getAncestor
+  (WordId wid, int level) const
+{
+  if(level <= 0) return 0; // root
+  if(level >= (int)m_word_levels[wid]) return m_words[wid]->id;
+  return m_ancestors[(size_t)(level - 1) * m_words.size() + wid];
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::getFeatureVector
+  (const std::vector<WordId> &words, FeatureVector &fv, int levelsup) const
+{
+  getFeatureVector(words, fv, levelsup, threadContext());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::getFeatureVector
+  (const std::vector<WordId> &words, FeatureVector &fv, int levelsup,
+   TransformContext &ctx) const
+{
+  // node at the same level as in transform
+  const int level = m_L - levelsup;
+  
+  std::vector<std::pair<NodeId, unsigned int> > &nodes = ctx.nodes;
+  nodes.clear();
+  nodes.reserve(words.size());
+  
+  for(unsigned int i_feature = 0; i_feature < words.size(); ++i_feature)
+  {
+    const WordId wid = words[i_feature];
+    if(m_words[wid]->weight > 0) // not stopped
+      nodes.push_back(std::make_pair(getAncestor(wid, level), i_feature));
+  }
+  
+  // the feature indexes are increasing, as in transform
+  std::sort(nodes.begin(), nodes.end());
+  fv.setFeatures(nodes);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::relevelFeatureVector
+  (const FeatureVector &fv, int levelsup, int new_levelsup, 
+   FeatureVector &out) const
+{
+  relevelFeatureVector(fv, levelsup, new_levelsup, out, threadContext());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::relevelFeatureVector
+  (const FeatureVector &fv, int levelsup, int new_levelsup, 
+   FeatureVector &out, TransformContext &ctx) const
+{
+  if(new_levelsup < levelsup)
+    throw std::string("TemplatedVocabulary: feature vectors can only be "
+      "moved up the tree");
+  
+  const int level = m_L - new_levelsup;
+  
+  std::vector<std::pair<NodeId, unsigned int> > &nodes = ctx.nodes;
+  nodes.clear();
+  nodes.reserve(fv.features());
+  
+  FeatureVector::const_iterator fit;
+  for(fit = fv.begin(); fit != fv.end(); ++fit)
+  {
+    // the nodes of fv are few, so that their ancestor is found by walking
+    // up from them
+    NodeId nid = fit->first;
+    int depth = 0;
+    for(NodeId p = nid; p != 0; p = m_nodes[p].parent) ++depth;
+    for(; depth > level; --depth) nid = m_nodes[nid].parent;
+    
+    const FeatureVector::Features features = fit->second;
+    for(unsigned int i = 0; i < features.size(); ++i)
+      nodes.push_back(std::make_pair(nid, features[i]));
+  }
+  
+  // the features of merged nodes are sorted again, as in transform
+  std::sort(nodes.begin(), nodes.end());
+  out.setFeatures(nodes);
 }
 
 // --------------------------------------------------------------------------
@@ -1261,10 +1633,16 @@ void TemplatedVocabulary<TDescriptor,F>::getWordsFromNode
 {
   words.clear();
   
+  WordId first, last;
   if(m_nodes[nid].isLeaf())
   {
     words.push_back(m_nodes[nid].word_id);
   }
+  else if(getWordsFromNode(nid, first, last))
+  {
+    words.reserve(last - first);
+    for(WordId wid = first; wid < last; ++wid) words.push_back(wid);
+  }
   else
   {
     words.reserve(m_k); // ^1, ^2, ...
@@ -1483,6 +1861,9 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
     m_nodes[nid].word_id = wid;
     m_words[wid] = &m_nodes[nid];
   }
+  
+  createAncestors();
+  createWordRanges();
 }
 
 // --------------------------------------------------------------------------
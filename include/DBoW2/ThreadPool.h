@@ -0,0 +1,105 @@
+/**
+ * File: ThreadPool.h
+ * Date: October 2026
+ * Description: persistent worker threads for parallel queries
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_THREAD_POOL__
+#define __D_T_THREAD_POOL__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace DBoW2 {
+
+/// Worker threads that are created once and run the tasks of many jobs
+/**
+ * A job is a number of tasks, identified by their index, that run in
+ * parallel. The thread that runs a job takes part in it and returns when
+ * all its tasks are done. Several threads can run jobs at once: the
+ * workers take the tasks of the jobs in order. Workers are created when a
+ * job needs more than there are, and live until the pool is destroyed,
+ * so that they keep their thread-local memory between jobs.
+ */
+class ThreadPool
+{
+public:
+
+  /**
+   * Creates a pool without workers
+   */
+  ThreadPool(void);
+
+  /**
+   * Stops the workers. No job can be running
+   */
+  ~ThreadPool(void);
+
+  /**
+   * Runs the tasks of a job and waits for them
+   * @param ntasks number of tasks. As many workers as ntasks - 1 are
+   *   created if there are fewer
+   * @param task function called with the index of each task, in
+   *   [0, ntasks)
+   */
+  void run(unsigned int ntasks,
+    const std::function<void(unsigned int)> &task);
+
+  /**
+   * Returns the number of workers
+   * @return number of threads created
+   */
+  size_t size() const;
+
+private:
+  ThreadPool(const ThreadPool &);
+  ThreadPool& operator=(const ThreadPool &);
+
+  /// Tasks of a job being run
+  struct Job
+  {
+    /// Function of the tasks
+    const std::function<void(unsigned int)> *task;
+    /// Number of tasks
+    unsigned int ntasks;
+    /// Next task to start
+    unsigned int next;
+    /// Number of tasks done
+    unsigned int done;
+  };
+
+  /**
+   * Loop of a worker
+   */
+  void work();
+
+private:
+
+  /// Protects the rest of the members and the jobs
+  mutable std::mutex m_mutex;
+
+  /// Signals new jobs to the workers
+  std::condition_variable m_ready;
+
+  /// Signals finished tasks to the threads that wait for their jobs
+  std::condition_variable m_done;
+
+  /// Jobs with tasks not started yet, in order. They are few, and a
+  /// vector keeps its memory when they finish
+  std::vector<Job*> m_jobs;
+
+  /// Worker threads
+  std::vector<std::thread> m_threads;
+
+  /// Whether the workers must finish
+  bool m_stop;
+};
+
+} // namespace DBoW2
+
+#endif
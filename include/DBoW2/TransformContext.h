@@ -0,0 +1,39 @@
+/**
+ * File: TransformContext.h
+ * Date: October 2026
+ * Description: reusable scratch memory for vocabulary transforms
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_TRANSFORM_CONTEXT__
+#define __D_T_TRANSFORM_CONTEXT__
+
+#include <vector>
+#include <utility>
+#include "BowVector.h"
+#include "FeatureVector.h"
+
+namespace DBoW2 {
+
+/// Scratch memory used to transform features into vectors
+/**
+ * A context owns the buffers the transform of a set of features needs, so
+ * that they are allocated only once when the same context is given to 
+ * consecutive transforms. A context can be used by only one transform at 
+ * a time, so each thread must have its own.
+ */
+class TransformContext
+{
+public:
+
+  /// <word id, weight> pairs of the features
+  std::vector<std::pair<WordId, WordValue> > words;
+  
+  /// <node id, feature index> pairs of the features
+  std::vector<std::pair<NodeId, unsigned int> > nodes;
+};
+
+} // namespace DBoW2
+
+#endif
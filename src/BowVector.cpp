@@ -33,9 +33,16 @@ BowVector::~BowVector(void)
 
 void BowVector::addWeight(WordId id, WordValue v)
 {
+  // words usually come in increasing order
+  if(empty() || back().first < id)
+  {
+    push_back(value_type(id, v));
+    return;
+  }
+  
   BowVector::iterator vit = this->lower_bound(id);
   
-  if(vit != this->end() && !(this->key_comp()(id, vit->first)))
+  if(vit != this->end() && vit->first == id)
   {
     vit->second += v;
   }
@@ -49,16 +56,74 @@ void BowVector::addWeight(WordId id, WordValue v)
 
 void BowVector::addIfNotExist(WordId id, WordValue v)
 {
-  BowVector::iterator vit = this->lower_bound(id);
+  insert(BowVector::value_type(id, v));
+}
+
+// --------------------------------------------------------------------------
+
+void BowVector::setWords(std::vector<std::pair<WordId, WordValue> > &words,
+  bool accumulate)
+{
+  clear();
+  if(words.empty()) return;
   
-  if(vit == this->end() || (this->key_comp()(id, vit->first)))
+  // sorted input is not sorted again, since the stable sort allocates
+  if(!std::is_sorted(words.begin(), words.end(), ltWord))
+    std::stable_sort(words.begin(), words.end(), ltWord);
+  
+  // the words are merged in a single pass
+  reserve(words.size());
+  std::vector<std::pair<WordId, WordValue> >::const_iterator wit;
+  for(wit = words.begin(); wit != words.end(); ++wit)
   {
-    this->insert(vit, BowVector::value_type(id, v));
+    if(empty() || back().first != wit->first)
+      push_back(*wit);
+    else if(accumulate)
+      back().second += wit->second;
   }
 }
 
 // --------------------------------------------------------------------------
 
+void BowVector::renumber(const std::vector<WordId> &new_ids)
+{
+  for(BowVector::iterator vit = begin(); vit != end(); ++vit)
+    vit->first = new_ids[vit->first];
+  
+  std::sort(begin(), end(), ltWord);
+}
+
+// --------------------------------------------------------------------------
+
+std::pair<BowVector::iterator, bool> BowVector::insert(const value_type &w)
+{
+  if(empty() || back().first < w.first)
+  {
+    push_back(w);
+    return std::make_pair(end() - 1, true);
+  }
+  
+  BowVector::iterator vit = this->lower_bound(w.first);
+  
+  if(vit != this->end() && vit->first == w.first)
+    return std::make_pair(vit, false);
+  else
+    return std::make_pair(this->insert(vit, w), true);
+}
+
+// --------------------------------------------------------------------------
+
+size_t BowVector::erase(WordId id)
+{
+  BowVector::iterator vit = this->find(id);
+  if(vit == this->end()) return 0;
+  
+  this->erase(vit);
+  return 1;
+}
+
+// --------------------------------------------------------------------------
+
 void BowVector::normalize(LNorm norm_type)
 {
   double norm = 0.0; 
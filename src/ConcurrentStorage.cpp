@@ -0,0 +1,81 @@
+/**
+ * File: ConcurrentStorage.cpp
+ * Date: October 2026
+ * Description: containers with one writer and many concurrent readers
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <vector>
+#include <new>
+#include "ConcurrentStorage.h"
+
+namespace DBoW2 {
+
+// ---------------------------------------------------------------------------
+
+MemoryReclaimer::MemoryReclaimer(void)
+{
+  m_epoch.store(0);
+  m_readers[0].store(0);
+  m_readers[1].store(0);
+}
+
+// ---------------------------------------------------------------------------
+
+MemoryReclaimer::~MemoryReclaimer(void)
+{
+  free(m_pending);
+  free(m_waiting);
+}
+
+// ---------------------------------------------------------------------------
+
+void MemoryReclaimer::retire(void *p, void (*destroy)(void*))
+{
+  m_pending.push_back(Retired(p, destroy));
+  collect();
+}
+
+// ---------------------------------------------------------------------------
+
+void MemoryReclaimer::free(const std::vector<Retired> &blocks)
+{
+  std::vector<Retired>::const_iterator it;
+  for(it = blocks.begin(); it != blocks.end(); ++it)
+  {
+    if(it->second) it->second(it->first);
+    else ::operator delete(it->first);
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+void MemoryReclaimer::collect()
+{
+  // Blocks were retired after being unpublished, so a reader that enters
+  // later cannot see them. The blocks waiting were retired before the last
+  // epoch change, so they can only be used by readers of the previous 
+  // epoch. When those are gone, the waiting blocks are freed and the 
+  // epoch changes again, so that the pending ones wait for the current
+  // readers. Two steps free everything if there are no readers
+  for(int step = 0; step < 2; ++step)
+  {
+    const unsigned int epoch = m_epoch.load();
+    
+    if(m_readers[1 - epoch].load() != 0) break;
+    
+    free(m_waiting);
+    
+    m_waiting.swap(m_pending);
+    m_pending.resize(0);
+    
+    if(m_waiting.empty()) break;
+    
+    m_epoch.store(1 - epoch);
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+} // namespace DBoW2
@@ -0,0 +1,184 @@
+/**
+ * File: DeltaCodec.cpp
+ * Date: October 2026
+ * Description: compression of increasing entry ids
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <cstring>
+#include "DeltaCodec.h"
+
+// MSVC defines __AVX2__ only, which implies SSSE3
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define DBOW2_SSSE3_DECODE
+#include <tmmintrin.h>
+#endif
+
+namespace DBoW2 {
+
+#ifdef DBOW2_SSSE3_DECODE
+
+/// Shuffles that expand the bytes of a group of 4 differences into 32-bit
+/// values, and the length of the group, for each control byte
+struct GroupShuffles
+{
+  unsigned char masks[256][16];
+  unsigned char lengths[256];
+
+  GroupShuffles()
+  {
+    for(int c = 0; c < 256; ++c)
+    {
+      int offset = 0;
+      for(int j = 0; j < 4; ++j)
+      {
+        const int len = ((c >> (2 * j)) & 3) + 1;
+        for(int b = 0; b < 4; ++b)
+          masks[c][4 * j + b] = (b < len ? offset + b : 0x80);
+        offset += len;
+      }
+      lengths[c] = (unsigned char)offset;
+    }
+  }
+};
+
+#endif
+
+// differences can be read as 32-bit words only on little endian hosts
+#if defined(_MSC_VER) || (defined(__BYTE_ORDER__) && \
+  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define DBOW2_DELTA_WORDS
+
+/// Masks of the bytes of a difference, by its length - 1
+static const unsigned int LENGTH_MASKS[4] = 
+  { 0xffu, 0xffffu, 0xffffffu, 0xffffffffu };
+
+#endif
+
+// ---------------------------------------------------------------------------
+
+size_t DeltaCodec::encode(const EntryId *ids, unsigned int n, EntryId base,
+  unsigned char *out)
+{
+  unsigned char *control = out;
+  unsigned char *data = out + (n + 3) / 4;
+
+  memset(control, 0, (n + 3) / 4);
+
+  EntryId prev = base;
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    unsigned int d = ids[i] - prev;
+    prev = ids[i];
+
+    int len = 1;
+    if(d >= (1u << 24)) len = 4;
+    else if(d >= (1u << 16)) len = 3;
+    else if(d >= (1u << 8)) len = 2;
+
+    control[i / 4] |= (unsigned char)((len - 1) << (2 * (i % 4)));
+    for(int b = 0; b < len; ++b, d >>= 8) *data++ = (unsigned char)d;
+  }
+
+  return data - out;
+}
+
+// ---------------------------------------------------------------------------
+
+size_t DeltaCodec::decode(const unsigned char *in, size_t bytes,
+  unsigned int n, EntryId base, EntryId *ids)
+{
+  const unsigned char *control = in;
+  const unsigned char *data = in + (n + 3) / 4;
+  unsigned int i = 0;
+
+#ifdef DBOW2_SSSE3_DECODE
+  static const GroupShuffles shuffles;
+
+  // groups, while 16 bytes can be loaded
+  __m128i prev = _mm_set1_epi32((int)base);
+  for(; i < n && data + 16 <= in + bytes; i += 4)
+  {
+    const unsigned char c = control[i / 4];
+
+    __m128i v = _mm_loadu_si128((const __m128i*)data);
+    v = _mm_shuffle_epi8(v,
+      _mm_loadu_si128((const __m128i*)shuffles.masks[c]));
+
+    // prefix sum of the differences
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+    v = _mm_add_epi32(v, prev);
+
+    _mm_storeu_si128((__m128i*)(ids + i), v);
+    prev = _mm_shuffle_epi32(v, 0xFF);
+    data += shuffles.lengths[c];
+  }
+
+  // the differences missing from the last group took one byte each
+  if(i > n)
+  {
+    data -= i - n;
+    i = n;
+  }
+
+  if(i > 0) base = ids[i - 1];
+#endif
+
+  EntryId prev_id = base;
+
+#ifdef DBOW2_DELTA_WORDS
+  // groups, while 16 bytes can be read. Each difference is read with 4
+  // bytes and masked, and the groups of 1-byte differences, which are the
+  // most common, are read directly
+  for(; i < n && data + 16 <= in + bytes; i += 4)
+  {
+    unsigned int c = control[i / 4];
+
+    if(c == 0)
+    {
+      prev_id += data[0]; ids[i] = prev_id;
+      prev_id += data[1]; ids[i + 1] = prev_id;
+      prev_id += data[2]; ids[i + 2] = prev_id;
+      prev_id += data[3]; ids[i + 3] = prev_id;
+      data += 4;
+      continue;
+    }
+
+    for(unsigned int j = 0; j < 4; ++j, c >>= 2)
+    {
+      unsigned int d;
+      memcpy(&d, data, sizeof(d));
+      prev_id += d & LENGTH_MASKS[c & 3];
+      ids[i + j] = prev_id;
+      data += (c & 3) + 1;
+    }
+  }
+
+  if(i > n)
+  {
+    prev_id = ids[n - 1];
+    data -= i - n;
+    i = n;
+  }
+#endif
+
+  for(; i < n; ++i)
+  {
+    const int len = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+
+    unsigned int d = 0;
+    for(int b = 0; b < len; ++b) d |= (unsigned int)data[b] << (8 * b);
+    data += len;
+
+    prev_id += d;
+    ids[i] = prev_id;
+  }
+
+  return data - in;
+}
+
+// ---------------------------------------------------------------------------
+
+} // namespace DBoW2
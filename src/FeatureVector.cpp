@@ -8,15 +8,25 @@
  */
 
 #include "FeatureVector.h"
-#include <map>
 #include <vector>
+#include <algorithm>
+#include <climits>
 #include <iostream>
 
 namespace DBoW2 {
 
 // ---------------------------------------------------------------------------
 
-FeatureVector::FeatureVector(void)
+/// Compares the node ids of two <node id, feature index> pairs
+static inline bool lessNode(const std::pair<NodeId, unsigned int> &a,
+  const std::pair<NodeId, unsigned int> &b)
+{
+  return a.first < b.first;
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureVector::FeatureVector(void): m_is_wide(false)
 {
 }
 
@@ -30,51 +40,155 @@ FeatureVector::~FeatureVector(void)
 
 void FeatureVector::addFeature(NodeId id, unsigned int i_feature)
 {
-  FeatureVector::iterator vit = this->lower_bound(id);
+  if(!m_is_wide && i_feature > USHRT_MAX) widen();
+  
+  if(m_offsets.empty()) m_offsets.push_back(0);
+  
+  if(m_nodes.empty() || m_nodes.back() < id)
+  {
+    // new last node
+    m_nodes.push_back(id);
+    m_offsets.push_back(m_offsets.back());
+  }
+  
+  std::vector<NodeId>::iterator nit = 
+    std::lower_bound(m_nodes.begin(), m_nodes.end(), id);
+  const size_t i = nit - m_nodes.begin();
   
-  if(vit != this->end() && vit->first == id)
+  if(*nit != id)
   {
-    vit->second.push_back(i_feature);
+    // new node in the middle
+    m_nodes.insert(nit, id);
+    m_offsets.insert(m_offsets.begin() + i + 1, m_offsets[i]);
   }
-  else
+  
+  // the feature goes at the end of the node
+  insertIndex(m_offsets[i+1], i_feature);
+  for(size_t j = i + 1; j < m_offsets.size(); ++j) ++m_offsets[j];
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::setFeatures
+  (std::vector<std::pair<NodeId, unsigned int> > &features)
+{
+  clear();
+  if(features.empty()) return;
+  
+  // sorted input is not sorted again, since the stable sort allocates
+  if(!std::is_sorted(features.begin(), features.end(), lessNode))
+    std::stable_sort(features.begin(), features.end(), lessNode);
+  
+  for(size_t i = 0; !m_is_wide && i < features.size(); ++i)
+    m_is_wide = (features[i].second > USHRT_MAX);
+  
+  if(m_is_wide) m_wide.reserve(features.size());
+  else m_narrow.reserve(features.size());
+  
+  m_offsets.push_back(0);
+  
+  std::vector<std::pair<NodeId, unsigned int> >::const_iterator fit;
+  for(fit = features.begin(); fit != features.end(); ++fit)
   {
-    vit = this->insert(vit, FeatureVector::value_type(id, 
-      std::vector<unsigned int>() ));
-    vit->second.push_back(i_feature);
+    if(m_nodes.empty() || m_nodes.back() != fit->first)
+    {
+      m_nodes.push_back(fit->first);
+      m_offsets.push_back(m_offsets.back());
+    }
+    
+    if(m_is_wide) m_wide.push_back(fit->second);
+    else m_narrow.push_back((unsigned short)fit->second);
+    ++m_offsets.back();
   }
 }
 
 // ---------------------------------------------------------------------------
 
+void FeatureVector::clear()
+{
+  m_nodes.clear();
+  m_offsets.clear();
+  m_narrow.clear();
+  m_wide.clear();
+  m_is_wide = false;
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureVector::const_iterator FeatureVector::lower_bound(NodeId id) const
+{
+  return const_iterator(this, 
+    std::lower_bound(m_nodes.begin(), m_nodes.end(), id) - m_nodes.begin());
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureVector::const_iterator FeatureVector::find(NodeId id) const
+{
+  const_iterator it = lower_bound(id);
+  if(it.index() < m_nodes.size() && m_nodes[it.index()] == id) return it;
+  else return end();
+}
+
+// ---------------------------------------------------------------------------
+
+size_t FeatureVector::memoryUsage() const
+{
+  return sizeof(FeatureVector) + 
+    m_nodes.capacity() * sizeof(NodeId) +
+    m_offsets.capacity() * sizeof(unsigned int) +
+    m_narrow.capacity() * sizeof(unsigned short) +
+    m_wide.capacity() * sizeof(unsigned int);
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::shrink()
+{
+  std::vector<NodeId>(m_nodes).swap(m_nodes);
+  std::vector<unsigned int>(m_offsets).swap(m_offsets);
+  std::vector<unsigned short>(m_narrow).swap(m_narrow);
+  std::vector<unsigned int>(m_wide).swap(m_wide);
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::widen()
+{
+  m_wide.assign(m_narrow.begin(), m_narrow.end());
+  std::vector<unsigned short>().swap(m_narrow);
+  m_is_wide = true;
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::insertIndex(unsigned int pos, unsigned int i_feature)
+{
+  if(m_is_wide) 
+    m_wide.insert(m_wide.begin() + pos, i_feature);
+  else 
+    m_narrow.insert(m_narrow.begin() + pos, (unsigned short)i_feature);
+}
+
+// ---------------------------------------------------------------------------
+
 std::ostream& operator<<(std::ostream &out, 
   const FeatureVector &v)
 {
-  if(!v.empty())
+  FeatureVector::const_iterator vit;
+  for(vit = v.begin(); vit != v.end(); ++vit)
   {
-    FeatureVector::const_iterator vit = v.begin();
+    const FeatureVector::Features f = vit->second;
+    
+    if(vit != v.begin()) out << ", ";
     
-    const std::vector<unsigned int>* f = &vit->second;
-
     out << "<" << vit->first << ": [";
-    if(!f->empty()) out << (*f)[0];
-    for(unsigned int i = 1; i < f->size(); ++i)
+    if(!f.empty()) out << f[0];
+    for(unsigned int i = 1; i < f.size(); ++i)
     {
-      out << ", " << (*f)[i];
+      out << ", " << f[i];
     }
     out << "]>";
-    
-    for(++vit; vit != v.end(); ++vit)
-    {
-      f = &vit->second;
-      
-      out << ", <" << vit->first << ": [";
-      if(!f->empty()) out << (*f)[0];
-      for(unsigned int i = 1; i < f->size(); ++i)
-      {
-        out << ", " << (*f)[i];
-      }
-      out << "]>";
-    }
   }
   
   return out;  
@@ -0,0 +1,71 @@
+/**
+ * File: ScoreAccumulator.cpp
+ * Date: October 2026
+ * Description: dense accumulator of entry scores for database queries
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <vector>
+#include <algorithm>
+#include "ScoreAccumulator.h"
+
+namespace DBoW2 {
+
+// ---------------------------------------------------------------------------
+
+ScoreAccumulator::ScoreAccumulator(void): m_min_words(0), m_with_sums(false)
+{
+}
+
+// ---------------------------------------------------------------------------
+
+void ScoreAccumulator::reset(unsigned int n, bool with_sums, 
+  unsigned int min_words)
+{
+  // only the entries touched by the last query must be cleared
+  std::vector<EntryId>::const_iterator tit;
+  for(tit = m_touched.begin(); tit != m_touched.end(); ++tit)
+  {
+    m_scores[*tit] = 0;
+    m_words[*tit] = 0;
+  }
+  
+  if(m_with_sums)
+  {
+    for(tit = m_touched.begin(); tit != m_touched.end(); ++tit)
+    {
+      m_sum_vi[*tit] = 0;
+      m_sum_wi[*tit] = 0;
+    }
+  }
+  
+  for(tit = m_counted.begin(); tit != m_counted.end(); ++tit)
+    m_counts[*tit] = 0;
+  
+  m_touched.resize(0);
+  m_counted.resize(0);
+  m_with_sums = with_sums;
+  
+  // counts saturate, so a greater minimum is taken as the maximum count
+  m_min_words = std::min(min_words, (unsigned int)USHRT_MAX);
+  
+  if(m_scores.size() < n)
+  {
+    m_scores.resize(n, 0);
+    m_words.resize(n, 0);
+  }
+  
+  if(m_min_words > 1 && m_counts.size() < n)
+    m_counts.resize(n, 0);
+  
+  if(with_sums && m_sum_vi.size() < n)
+  {
+    m_sum_vi.resize(n, 0);
+    m_sum_wi.resize(n, 0);
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+} // namespace DBoW2
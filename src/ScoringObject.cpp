@@ -13,9 +13,12 @@
 
 using namespace DBoW2;
 
-// If you change the type of WordValue, make sure you change also the
-// epsilon value (this is needed by the KL method)
-const double GeneralScoring::LOG_EPS = log(DBL_EPSILON); // FLT_EPSILON
+// The epsilon must be that of WordValue (this is needed by the KL method)
+#ifdef DBOW2_FLOAT_WORD_VALUE
+const double GeneralScoring::LOG_EPS = log(FLT_EPSILON);
+#else
+const double GeneralScoring::LOG_EPS = log(DBL_EPSILON);
+#endif
 
 // ---------------------------------------------------------------------------
 // ---------------------------------------------------------------------------
@@ -47,13 +50,13 @@ double L1Scoring::score(const BowVector &v1, const BowVector &v2) const
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
+      v1_it = v1.seek(v1_it, v2_it->first);
       // v1_it = (first element >= v2_it.id)
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
+      v2_it = v2.seek(v2_it, v1_it->first);
       // v2_it = (first element >= v1_it.id)
     }
   }
@@ -97,13 +100,13 @@ double L2Scoring::score(const BowVector &v1, const BowVector &v2) const
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
+      v1_it = v1.seek(v1_it, v2_it->first);
       // v1_it = (first element >= v2_it.id)
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
+      v2_it = v2.seek(v2_it, v1_it->first);
       // v2_it = (first element >= v1_it.id)
     }
   }
@@ -154,12 +157,12 @@ double ChiSquareScoring::score(const BowVector &v1, const BowVector &v2)
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
+      v1_it = v1.seek(v1_it, v2_it->first);
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
+      v2_it = v2.seek(v2_it, v1_it->first);
     }
   }
     
@@ -207,7 +210,7 @@ double KLScoring::score(const BowVector &v1, const BowVector &v2) const
     else
     {
       // move v2_it forward, do not add any score
-      v2_it = v2.lower_bound(v1_it->first);
+      v2_it = v2.seek(v2_it, v1_it->first);
       // v2_it = (first element >= v1_it.id)
     }
   }
@@ -251,13 +254,13 @@ double BhattacharyyaScoring::score(const BowVector &v1,
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
+      v1_it = v1.seek(v1_it, v2_it->first);
       // v1_it = (first element >= v2_it.id)
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
+      v2_it = v2.seek(v2_it, v1_it->first);
       // v2_it = (first element >= v1_it.id)
     }
   }
@@ -296,13 +299,13 @@ double DotProductScoring::score(const BowVector &v1,
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
+      v1_it = v1.seek(v1_it, v2_it->first);
       // v1_it = (first element >= v2_it.id)
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
+      v2_it = v2.seek(v2_it, v1_it->first);
       // v2_it = (first element >= v1_it.id)
     }
   }
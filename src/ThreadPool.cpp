@@ -0,0 +1,110 @@
+/**
+ * File: ThreadPool.cpp
+ * Date: October 2026
+ * Description: persistent worker threads for parallel queries
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <algorithm>
+#include "ThreadPool.h"
+
+namespace DBoW2 {
+
+// ---------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(void): m_stop(false)
+{
+}
+
+// ---------------------------------------------------------------------------
+
+ThreadPool::~ThreadPool(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_ready.notify_all();
+
+  for(size_t i = 0; i < m_threads.size(); ++i) m_threads[i].join();
+}
+
+// ---------------------------------------------------------------------------
+
+size_t ThreadPool::size() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_threads.size();
+}
+
+// ---------------------------------------------------------------------------
+
+void ThreadPool::run(unsigned int ntasks,
+  const std::function<void(unsigned int)> &task)
+{
+  if(ntasks == 0) return;
+  if(ntasks == 1)
+  {
+    task(0);
+    return;
+  }
+
+  Job job;
+  job.task = &task;
+  job.ntasks = ntasks;
+  job.next = 0;
+  job.done = 0;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  while(m_threads.size() < ntasks - 1)
+    m_threads.push_back(std::thread(&ThreadPool::work, this));
+
+  m_jobs.push_back(&job);
+  m_ready.notify_all();
+
+  // this thread takes the tasks of its job too, so that the job finishes
+  // even if the workers are busy with other jobs
+  while(job.next < job.ntasks)
+  {
+    const unsigned int i = job.next++;
+    if(job.next == job.ntasks)
+      m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &job));
+
+    lock.unlock();
+    task(i);
+    lock.lock();
+
+    ++job.done;
+  }
+
+  while(job.done < job.ntasks) m_done.wait(lock);
+}
+
+// ---------------------------------------------------------------------------
+
+void ThreadPool::work()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for(;;)
+  {
+    while(!m_stop && m_jobs.empty()) m_ready.wait(lock);
+    if(m_stop) return;
+
+    Job &job = *m_jobs.front();
+    const unsigned int i = job.next++;
+    if(job.next == job.ntasks) m_jobs.erase(m_jobs.begin());
+
+    lock.unlock();
+    (*job.task)(i);
+    lock.lock();
+
+    if(++job.done == job.ntasks) m_done.notify_all();
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+} // namespace DBoW2